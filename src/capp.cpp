@@ -1,39 +1,118 @@
 #include <algorithm>
 #include <boost/filesystem.hpp>
 #include <boost/process.hpp>
+#include <chrono>
+#include <fcntl.h>
+#include <functional>
+#include <poll.h>
+#include <signal.h>
 #include <sstream>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "json.h"
 
 #include "capp.h"
+#include "cgroup.h"
 #include "context.h"
+#include "daemon.h"
+#include "image.h"
+#include "logs.h"
 #include "oci-hooks.h"
+#include "overlay.h"
 #include "project.h"
+#include "relay.h"
+#include "state.h"
 #include "utils.h"
 
 #ifndef DOCKER_ARCH
 #error Missing DOCKER_ARCH
 #endif
 
-static bool is_mounted(const std::string &path) {
-  auto file = open_read("/proc/mounts");
+#ifndef STATX_ATTR_MOUNT_ROOT
+#define STATX_ATTR_MOUNT_ROOT 0x00002000
+#endif
+
+// mountinfo escapes space, tab, newline and backslash as \ooo
+static std::string mountinfo_unescape(const std::string &field) {
+  auto octal = [](char c) { return c >= '0' && c <= '7'; };
+  std::string out;
+  for (size_t i = 0; i < field.size(); i++) {
+    if (field[i] == '\\' && i + 3 < field.size() && octal(field[i + 1]) &&
+        octal(field[i + 2]) && octal(field[i + 3])) {
+      out += (char)std::stoi(field.substr(i + 1, 3), nullptr, 8);
+      i += 3;
+    } else {
+      out += field[i];
+    }
+  }
+  return out;
+}
+
+static bool mountinfo_has(const std::string &path) {
+  std::string target;
+  try {
+    target = boost::filesystem::canonical(path).string();
+  } catch (const std::exception &ex) {
+    return false;
+  }
+  auto file = open_read("/proc/self/mountinfo");
   std::string line;
   while (getline(file, line)) {
-    auto start = line.find(' ') + 1;
-    auto end = line.find(' ', start + 1);
-    auto mnt = line.substr(start, end - start);
-    if (mnt == path) {
+    // id parent major:minor root mount-point options...
+    std::istringstream fields(line);
+    std::string id, parent, dev, root, mnt;
+    if (fields >> id >> parent >> dev >> root >> mnt &&
+        mountinfo_unescape(mnt) == target) {
       return true;
     }
   }
   return false;
 }
 
+// Whether `path` is the root of a mount. Newer kernels answer this directly
+// through statx(), otherwise its mount ID or device is compared with its
+// parent's. mountinfo is only scanned when neither can tell, e.g. a bind
+// mount on a kernel without mount IDs.
+static bool is_mounted(const std::string &path) {
+  unsigned int flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT;
+#ifdef HAVE_STATX_MNT_ID
+  unsigned int mask = STATX_TYPE | STATX_MNT_ID;
+#else
+  unsigned int mask = STATX_TYPE;
+#endif
+  struct statx stx;
+  if (statx(AT_FDCWD, path.c_str(), flags, mask, &stx) != 0) {
+    return errno == ENOENT ? false : mountinfo_has(path);
+  }
+  if (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT) {
+    return stx.stx_attributes & STATX_ATTR_MOUNT_ROOT;
+  }
+
+  struct statx parent;
+  auto up = path + "/..";
+  if (statx(AT_FDCWD, up.c_str(), flags, mask, &parent) == 0) {
+#ifdef HAVE_STATX_MNT_ID
+    if (stx.stx_mask & parent.stx_mask & STATX_MNT_ID) {
+      return stx.stx_mnt_id != parent.stx_mnt_id;
+    }
+#endif
+    if (stx.stx_dev_major != parent.stx_dev_major ||
+        stx.stx_dev_minor != parent.stx_dev_minor) {
+      return true;
+    }
+  }
+  return mountinfo_has(path);
+}
+
 static boost::filesystem::path
-overlay_mount(const Context &ctx, const boost::filesystem::path &imgdir,
-              const boost::filesystem::path &base) {
+overlay_mount(const Context &ctx,
+              const std::vector<boost::filesystem::path> &lower,
+              const boost::filesystem::path &base,
+              const std::vector<std::string> &options) {
   auto rootfs = base / "rootfs";
   boost::filesystem::create_directories(rootfs);
   auto upper = base / ".upper";
@@ -46,14 +125,25 @@ overlay_mount(const Context &ctx, const boost::filesystem::path &imgdir,
     return rootfs;
   }
 
-  std::string cmd = "mount -t overlay overlay -o lowerdir=";
-  cmd += imgdir.string() + ",upperdir=" + upper.string() +
-         ",workdir=" + work.string() + " " + rootfs.string();
+  // Changes to a volatile overlay may not have reached the disk, so the
+  // kernel refuses to mount its upper dir again
+  if (boost::filesystem::exists(work / "work" / "incompat" / "volatile")) {
+    ctx.out() << "Discarding changes from volatile overlay\n";
+    boost::filesystem::remove_all(upper);
+    boost::filesystem::remove_all(work);
+    boost::filesystem::create_directories(upper);
+    boost::filesystem::create_directories(work);
+  }
 
-  ctx.out() << "Mounting overlay\n";
-  if (boost::process::system(cmd) != 0) {
-    throw std::runtime_error("Unable to mount overlayfs");
+  // Record the layers in use so they aren't pruned from under the mount
+  auto lowerf = open_write(base / ".lower");
+  for (const auto &p : lower) {
+    lowerf << p.string() << "\n";
   }
+  lowerf.close();
+
+  ctx.out() << "Mounting overlay\n";
+  overlay_mount(lower, upper, work, rootfs, options);
   return rootfs;
 }
 
@@ -104,8 +194,8 @@ static boost::filesystem::path create_resolv_conf(const Context &ctx,
   return resolv_conf;
 }
 
-static void up(const Context &ctx, const Service &svc,
-               const std::vector<Volume> &volumes) {
+static up_config prepare(const Context &ctx, const Service &svc,
+                         const std::vector<Volume> &volumes) {
   ctx.out() << "Starting " << svc.name << "\n";
   auto spec = get_spec(svc.name);
   auto hosts = ctx.var_run / "etc_hosts";
@@ -116,85 +206,279 @@ static void up(const Context &ctx, const Service &svc,
 
   auto resolv_conf = create_resolv_conf(ctx, svc);
 
-  auto imgdir = ctx.var_lib / "images" / svc.name;
-  if (!boost::filesystem::is_directory(imgdir)) {
-    throw std::runtime_error("Could not find image for service");
+  auto lower = image_layers(ctx, svc.name);
+
+  up_config cfg;
+  cfg.rootfs = overlay_mount(ctx, lower, ctx.var_lib / "mounts" / svc.name,
+                            svc.overlay_opts);
+
+  cfg.config = ctx.var_run / svc.name / "config.json";
+  boost::filesystem::create_directories(cfg.config.parent_path());
+  cfg.spec_sha1 = sha1sum(spec);
+  cfg.restart = svc.restart;
+  AppState::Started(ctx, svc.name, spec, cfg.spec_sha1);
+  ocispec_create(ctx.app, ctx.volumes(), svc, volumes, spec, cfg.config,
+                 cfg.rootfs, hosts, resolv_conf, ctx.seccomp_cache());
+  return cfg;
+}
+
+// Closes a file descriptor, if there is one, when going out of scope
+class FdCloser {
+public:
+  explicit FdCloser(int fd) : fd_(fd) {}
+  ~FdCloser() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+  FdCloser(const FdCloser &) = delete;
+  FdCloser &operator=(const FdCloser &) = delete;
+
+  int get() const { return fd_; }
+
+private:
+  int fd_;
+};
+
+// Copy crun's output to our stderr, as-is unless CAPPRUN_LOG_FORMAT asks for
+// it to be framed
+static void relay_output(const Context &ctx, const std::string &svc_name,
+                         int fd) {
+  auto opts = LogOptions::Load(LogFormat::Raw);
+  if (opts.format == LogFormat::Raw && opts.rate > 0) {
+    opts.format = LogFormat::Text; // rate limiting needs lines
   }
 
-  auto rootfs = overlay_mount(ctx, imgdir, ctx.var_lib / "mounts" / svc.name);
+  if (opts.format == LogFormat::Raw) {
+    std::vector<int> sinks = {STDERR_FILENO};
+    const char *log_file = getenv("CAPPRUN_LOG_FILE");
+    // splice() refuses O_APPEND files, relay() copies to it instead. It's
+    // closed once the container exits as up() relays again for each restart.
+    FdCloser log_fd(
+        log_file == nullptr
+            ? -1
+            : open(log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640));
+    if (log_file != nullptr) {
+      if (log_fd.get() < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                std::string("Unable to open ") + log_file);
+      }
+      sinks.push_back(log_fd.get());
+    }
+    relay(fd, sinks);
+    return;
+  }
 
-  auto dst = ctx.var_run / svc.name / "config.json";
-  boost::filesystem::create_directories(dst.parent_path());
-  auto sha1 = sha1sum(spec);
-  ocispec_create(ctx.app, ctx.volumes(), svc, volumes, spec, dst, rootfs, hosts,
-                 resolv_conf);
+  LogPipeline logs(opts, ctx.app, STDERR_FILENO);
+  auto stream = logs.stream(svc_name, "");
+  char buf[65536];
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to read container output");
+    } else if (n == 0) {
+      break;
+    }
+    stream->write(buf, n);
+  }
+  stream->flush();
+}
 
-  ctx.out() << "Execing: crun run -f " << dst << " " << ctx.app << "-"
-            << svc.name << "\n";
-  const char *crun =
-      strdup(boost::process::search_path("crun").string().c_str());
-  const char *name = strdup((ctx.app + "-" + svc.name).c_str());
-  const char *config = strdup(dst.string().c_str());
+// Set by SIGTERM/SIGINT, which are passed on to crun
+static volatile sig_atomic_t stopping = 0;
+static volatile int crun_pidfd = -1;
+
+static void on_stop(int sig) {
+  stopping = 1;
+#ifdef SYS_pidfd_send_signal
+  if (crun_pidfd >= 0) {
+    syscall(SYS_pidfd_send_signal, crun_pidfd, sig, nullptr, 0);
+  }
+#endif
+}
+
+// Run the container once, returning crun's wait status
+static int run_crun(const Context &ctx, const std::string &svc_name,
+                    const up_config &cfg) {
+  ctx.out() << "Execing: crun run -f " << cfg.config << " " << ctx.app << "-"
+            << svc_name << "\n";
+  ctx.out().flush();
+  auto crun = boost::process::search_path("crun").string();
+  auto name = ctx.app + "-" + svc_name;
+  auto config = cfg.config.string();
 
   // Why fork/exec just to dump out the content as-is?
   // SystemD's journal uses a socket for the stdout/stderr file descriptor.
   // Docker uses a pipe and many containers, such as nginx, require their
   // /dev/std[out|err] to be a pipe and can fail in very hard to diagnose
   // ways since they'll not actually provide any output when they crash.
-  std::string failure = "Unable to execute crun";
   // TODO if tty, this should be changed
-  pid_t pid;
   int pipefd[2];
-  if (pipe(pipefd) == -1) {
-    goto cleanup;
+  if (pipe2(pipefd, O_CLOEXEC) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to execute crun");
   }
-  pid = fork();
+  pid_t pid = fork();
   if (pid == -1) {
-    goto cleanup;
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to execute crun");
   } else if (pid == 0) {
-    setenv("OCISPEC_SHA1", sha1.c_str(), 1);
-    close(pipefd[0]);
+    setenv("OCISPEC_SHA1", cfg.spec_sha1.c_str(), 1);
     dup2(pipefd[1], STDERR_FILENO);
     dup2(pipefd[1], STDOUT_FILENO);
-    if (execl(crun, crun, "run", "-f", config, name, NULL) == -1) {
+    execl(crun.c_str(), crun.c_str(), "run", "-f", config.c_str(),
+          name.c_str(), NULL);
+    perror("Unable to execute crun");
+    _exit(127);
+  }
+  close(pipefd[1]);
+#ifdef SYS_pidfd_open
+  // A pidfd can't end up signalling an unrelated process that reused the pid
+  crun_pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+
+  try {
+    relay_output(ctx, svc_name, pipefd[0]);
+  } catch (...) {
+    close(pipefd[0]);
+    throw;
+  }
+  close(pipefd[0]);
+
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) {
       throw std::system_error(errno, std::generic_category(),
-                              "Unable to execute crun");
+                              "Unable to get exit code from crun");
     }
   }
+  if (crun_pidfd >= 0) {
+    int fd = crun_pidfd;
+    crun_pidfd = -1;
+    close(fd);
+  }
+  return status;
+}
 
-  char buffer[BUFSIZ];
-  ssize_t bytes_read;
-  close(pipefd[1]);
-  while (1) {
-    bytes_read = read(pipefd[0], buffer, sizeof(buffer));
-    if (bytes_read < 0 && errno == EINTR) {
-      continue;
-    } else if (bytes_read < 0) {
-      failure = "Unable to read container output";
-      goto cleanup;
-    } else if (bytes_read == 0) {
-      int status;
-      if (waitpid(pid, &status, 0) == -1) {
-        failure = "Unable to get exit code from crun";
-        goto cleanup;
+// A parsed compose `restart:` value
+struct restart_policy {
+  enum { Never, Always, OnFailure, UnlessStopped } mode;
+  unsigned max_retries; // on-failure:<max>, 0 for no limit
+};
+
+static restart_policy parse_restart(const std::string &val) {
+  if (val.empty() || val == "no") {
+    return {restart_policy::Never, 0};
+  } else if (val == "always") {
+    return {restart_policy::Always, 0};
+  } else if (val == "unless-stopped") {
+    return {restart_policy::UnlessStopped, 0};
+  } else if (val == "on-failure") {
+    return {restart_policy::OnFailure, 0};
+  } else if (val.rfind("on-failure:", 0) == 0) {
+    return {restart_policy::OnFailure, (unsigned)std::stoul(val.substr(11))};
+  }
+  throw std::runtime_error("Invalid restart policy: " + val);
+}
+
+static bool should_restart(const restart_policy &policy, int status,
+                           unsigned restarts) {
+  if (stopping || policy.mode == restart_policy::Never) {
+    return false;
+  }
+  if (policy.mode == restart_policy::OnFailure) {
+    bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    return failed && (policy.max_retries == 0 || restarts < policy.max_retries);
+  }
+  return true;
+}
+
+// Whether a restart can reuse the config.json and rootfs already in place
+static bool can_reuse(const Context &ctx, const std::string &svc_name,
+                      const up_config &cfg) {
+  if (!boost::filesystem::exists(cfg.config) ||
+      !is_mounted(cfg.rootfs.string())) {
+    return false;
+  }
+  AppState state(ctx);
+  auto it = state.services.find(svc_name);
+  return it != state.services.end() &&
+         it->second.spec_sha1 == cfg.spec_sha1 &&
+         spec_current(it->second, get_spec(svc_name));
+}
+
+// Run the container, restarting it as its compose restart policy says. While
+// supervised, the poststop hook leaves the rootfs mounted so a restart only
+// needs to exec crun again, unless the service's spec has changed.
+static void up(const Context &ctx, const std::string &svc_name,
+               up_config cfg, const std::function<up_config()> &prepare) {
+  auto policy = parse_restart(cfg.restart);
+  auto marker = ctx.var_run / svc_name / "supervisor.pid";
+  if (policy.mode != restart_policy::Never) {
+    struct sigaction sa {};
+    sa.sa_handler = on_stop;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGINT, &sa, nullptr);
+    open_write(marker) << getpid();
+  }
+
+  int status;
+  unsigned restarts = 0;
+  unsigned failures = 0;
+  try {
+    while (true) {
+      auto started = std::chrono::steady_clock::now();
+      status = run_crun(ctx, svc_name, cfg);
+      if (!should_restart(policy, status, restarts)) {
+        break;
+      }
+
+      // Back off exponentially, starting over once it's run for a while
+      if (std::chrono::steady_clock::now() - started >
+          std::chrono::seconds(10)) {
+        failures = 0;
       }
+      int delay = std::min(30000, 100 << std::min(failures, 9U));
+      failures++;
+      restarts++;
       if (WIFEXITED(status)) {
-        exit(WEXITSTATUS(status));
+        ctx.out() << svc_name << " exited with rc=" << WEXITSTATUS(status);
+      } else {
+        ctx.out() << svc_name << " killed with sig=" << WTERMSIG(status);
+      }
+      ctx.out() << ", restarting in " << delay << "ms\n";
+      ctx.out().flush();
+      poll(nullptr, 0, delay);
+      if (stopping) {
+        break;
+      }
+      if (!can_reuse(ctx, svc_name, cfg)) {
+        umount(cfg.rootfs.c_str());
+        cfg = prepare();
       }
-      throw std::runtime_error("Unknown waitpid rc: " + std::to_string(status));
     }
-    fwrite(buffer, bytes_read, 1, stderr);
+  } catch (...) {
+    boost::filesystem::remove(marker);
+    umount(cfg.rootfs.c_str());
+    throw;
   }
 
-cleanup:
-  umount(rootfs.c_str());
-  throw std::system_error(errno, std::generic_category(), failure);
+  if (policy.mode != restart_policy::Never) {
+    boost::filesystem::remove(marker);
+    umount(cfg.rootfs.c_str());
+  }
+  if (WIFEXITED(status)) {
+    exit(WEXITSTATUS(status));
+  }
+  throw std::runtime_error("Unknown waitpid rc: " + std::to_string(status));
 }
 
-void capp_up(const std::string &app_name, const std::string &svc) {
-  auto ctx = Context::Load(app_name);
-  auto proj = ProjectDefinition::Load("docker-compose.json");
-
+up_config capp_prepare(const Context &ctx, const ProjectDefinition &proj,
+                       const std::string &svc) {
   for (const auto &v : proj.volumes) {
     auto p = ctx.volumes() / v.name;
     if (!boost::filesystem::exists(p)) {
@@ -203,46 +487,40 @@ void capp_up(const std::string &app_name, const std::string &svc) {
     }
   }
 
-  up(ctx, proj.get_service(svc), proj.volumes);
+  return prepare(ctx, proj.get_service(svc), proj.volumes);
 }
 
-static void pull(const Context &ctx, const Service &svc) {
-  ctx.out() << "Pulling " << svc.name << ": " << svc.image << "\n";
-  std::string cmd = "docker pull ";
-  boost::process::system(cmd + svc.image);
-  ctx.out() << "Extracting\n";
-  cmd = "docker create " + svc.image;
-  boost::process::ipstream out;
-  boost::process::system(cmd, boost::process::std_out > out);
-  std::string id;
-  out >> id;
-
-  auto imgdir = ctx.var_lib / "images" / svc.name;
-  boost::filesystem::create_directories(imgdir);
-
-  boost::process::pipe intermediate;
-  boost::process::child docker_export(boost::process::search_path("docker"),
-                                      "export", id,
-                                      boost::process::std_out > intermediate);
-  boost::process::child extract(boost::process::search_path("tar"), "-C",
-                                imgdir, "-xf", "-",
-                                boost::process::std_in < intermediate);
-
-  docker_export.wait();
-  extract.wait();
+void capp_up(const std::string &app_name, const std::string &svc) {
+  auto ctx = Context::Load(app_name);
+
+  // Also used when a restart finds the service's spec has changed
+  auto prepare = [&ctx, &svc]() {
+    nlohmann::json resp;
+    if (daemon_call(ctx, {{"cmd", "up"}, {"service", svc}}, resp)) {
+      up_config cfg;
+      cfg.config = resp["config"].get<std::string>();
+      cfg.rootfs = resp["rootfs"].get<std::string>();
+      cfg.spec_sha1 = resp["spec_sha1"].get<std::string>();
+      cfg.restart = resp.value("restart", "no");
+      return cfg;
+    }
+    auto proj = ProjectDefinition::Load("docker-compose.json");
+    return capp_prepare(ctx, proj, svc);
+  };
+  up(ctx, svc, prepare(), prepare);
 }
 
-void capp_pull(const std::string &app_name, const std::string &svc) {
+void capp_pull(const std::string &app_name, const std::string &svc,
+               size_t jobs) {
   auto ctx = Context::Load(app_name);
   auto proj = ProjectDefinition::Load("docker-compose.json");
 
   if (svc.size() != 0) {
-    pull(ctx, proj.get_service(svc));
+    image_pull(ctx, {proj.get_service(svc)}, jobs);
   } else {
-    for (const auto &svc : proj.services) {
-      pull(ctx, svc);
-    }
+    image_pull(ctx, proj.services, jobs);
   }
+  image_prune(ctx);
 }
 
 static std::vector<std::string> _unit_deps(const std::string &unit) {
@@ -360,46 +638,99 @@ void capp_sync_systemd(const boost::filesystem::path &units_dir,
   }
 }
 
-static void status(const Context &ctx, const Service &svc) {
-  ctx.out() << "Checking status of " << svc.name << "\n";
+// The pid of the container's init process or -1 if crun isn't running it
+static int crun_pid(const Context &ctx, const std::string &svc_name) {
   boost::filesystem::path p("/var/run/crun");
-  p = p / (ctx.app + "-" + svc.name);
+  p = p / (ctx.app + "-" + svc_name);
 
   nlohmann::json data;
   try {
     open_read(p / "status") >> data;
   } catch (const std::exception &ex) {
-    ctx.out() << " not running\n";
-    return;
+    return -1;
+  }
+  return data["pid"].get<int>();
+}
+
+bool capp_running(const Context &ctx, const std::string &svc) {
+  int pid = crun_pid(ctx, svc);
+  return pid > 0 && kill(pid, 0) == 0;
+}
+
+// The state of a service as {name, state[, pid, spec]}. With `metrics` its
+// uptime and cgroup resource usage are included.
+static nlohmann::json status(const Context &ctx, const Service &svc,
+                             service_state *state, bool metrics) {
+  nlohmann::json out = {{"name", svc.name}, {"state", "stopped"}};
+  int pid = state == nullptr ? crun_pid(ctx, svc.name) : state->pid;
+  if (pid < 0 || kill(pid, 0) != 0) {
+    return out;
   }
+  out["state"] = "running";
+  out["pid"] = pid;
+
+  if (state == nullptr) {
+    // Started before state was recorded, all we know is if it's running
+    out["spec"] = "needs-updating";
+    if (metrics) {
+      out["cgroup"] = cgroup_metrics(cgroup_path(pid));
+    }
+    return out;
+  }
+  bool current = spec_current(*state, get_spec(svc.name));
+  out["spec"] = current ? "up-to-date" : "needs-updating";
+  if (metrics) {
+    out["uptime"] = std::max<int64_t>(0, time(nullptr) - state->started);
+    out["cgroup"] = cgroup_metrics(state->cgroup);
+  }
+  return out;
+}
 
-  auto pid = data["pid"].get<int>();
-  ctx.out() << " pid(" << pid << ")";
-  boost::filesystem::path proc("/proc");
-  auto f = open_read(proc / std::to_string(pid) / "stat");
-  std::string buf;
-  // parent is 4th item
-  f >> buf;
-  f >> buf;
-  f >> buf;
-  f >> buf;
-  f = open_read(proc / buf / "environ");
-  f >> buf;
-  auto idx = buf.find("OCISPEC_SHA1");
-  idx += 13;
-  buf = buf.substr(idx, 40);
-  auto sha1 = sha1sum(get_spec(svc.name));
-  if (sha1 == buf) {
-    ctx.out() << " up-to-date\n";
+void capp_status(const Context &ctx, const ProjectDefinition &proj,
+                 bool json) {
+  nlohmann::json services = nlohmann::json::array();
+  if (!boost::filesystem::exists(ctx.var_run / "state.json")) {
+    for (const auto &svc : proj.services) {
+      services.push_back(status(ctx, svc, nullptr, json));
+    }
   } else {
-    ctx.out() << " needs-updating\n";
+    AppState state(ctx);
+    auto before = state.services;
+    for (const auto &svc : proj.services) {
+      auto it = state.services.find(svc.name);
+      auto s = it == state.services.end() ? nullptr : &it->second;
+      services.push_back(status(ctx, svc, s, json));
+    }
+    // Remember specs that were touched but not changed
+    for (const auto &it : state.services) {
+      if (it.second.spec_mtime != before[it.first].spec_mtime) {
+        state.save();
+        break;
+      }
+    }
+  }
+
+  if (json) {
+    ctx.out() << nlohmann::json{{"app", ctx.app}, {"services", services}}
+              << "\n";
+    return;
+  }
+  for (const auto &svc : services) {
+    ctx.out() << "Checking status of " << svc["name"].get<std::string>()
+              << "\n";
+    if (svc["state"] == "running") {
+      ctx.out() << " pid(" << svc["pid"].get<int>() << ") "
+                << svc["spec"].get<std::string>() << "\n";
+    } else {
+      ctx.out() << " not running\n";
+    }
   }
 }
 
-void capp_status(const std::string &app_name) {
+void capp_status(const std::string &app_name, bool json) {
   auto ctx = Context::Load(app_name);
-  auto proj = ProjectDefinition::Load("docker-compose.json");
-  for (const auto &svc : proj.services) {
-    status(ctx, svc);
+  nlohmann::json resp;
+  if (!daemon_call(ctx, {{"cmd", "status"}, {"json", json}}, resp)) {
+    capp_status(ctx, ProjectDefinition::Load("docker-compose.json"), json);
   }
-}
\ No newline at end of file
+}
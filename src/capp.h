@@ -1,9 +1,28 @@
 #pragma once
 
+#include <boost/filesystem.hpp>
 #include <string>
 
-void capp_pull(const std::string &app_name, const std::string &svc);
+#include "context.h"
+#include "project.h"
+
+// What's needed to exec crun for a service
+struct up_config {
+  boost::filesystem::path config;
+  boost::filesystem::path rootfs;
+  std::string spec_sha1;
+  std::string restart; // the service's compose restart policy
+};
+
+void capp_pull(const std::string &app_name, const std::string &svc,
+               size_t jobs);
 void capp_up(const std::string &app_name, const std::string &svc);
 void capp_sync_systemd(const boost::filesystem::path &units_dir,
                        const std::string &app_name);
-void capp_status(const std::string &app_name);
\ No newline at end of file
+void capp_status(const std::string &app_name, bool json);
+
+up_config capp_prepare(const Context &ctx, const ProjectDefinition &proj,
+                       const std::string &svc);
+void capp_status(const Context &ctx, const ProjectDefinition &proj,
+                 bool json);
+bool capp_running(const Context &ctx, const std::string &svc);
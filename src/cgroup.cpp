@@ -0,0 +1,119 @@
+#include "cgroup.h"
+
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <sstream>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+static const char *cgroup2_root() {
+  static const char *root = [] {
+    struct statfs fs;
+    if (statfs("/sys/fs/cgroup", &fs) == 0 &&
+        fs.f_type == CGROUP2_SUPER_MAGIC) {
+      return "/sys/fs/cgroup";
+    }
+    return "/sys/fs/cgroup/unified"; // hybrid hierarchy
+  }();
+  return root;
+}
+
+// Read a small file relative to `dirfd`, returns false if it doesn't exist
+static bool read_at(int dirfd, const char *name, std::string &buf) {
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  char tmp[4096];
+  buf.clear();
+  ssize_t n;
+  while ((n = read(fd, tmp, sizeof(tmp))) > 0) {
+    buf.append(tmp, n);
+  }
+  close(fd);
+  return n == 0;
+}
+
+// Parse "key value" lines such as cpu.stat
+static nlohmann::json flat_keyed(const std::string &buf) {
+  nlohmann::json out = nlohmann::json::object();
+  std::istringstream in(buf);
+  std::string key;
+  uint64_t val;
+  while (in >> key >> val) {
+    out[key] = val;
+  }
+  return out;
+}
+
+// Sum the "maj:min key=value ..." lines of io.stat across devices
+static nlohmann::json io_totals(const std::string &buf) {
+  nlohmann::json out = {{"rbytes", 0}, {"wbytes", 0}, {"rios", 0},
+                        {"wios", 0},   {"dbytes", 0}, {"dios", 0}};
+  std::istringstream in(buf);
+  std::string word;
+  while (in >> word) {
+    auto eq = word.find('=');
+    if (eq == std::string::npos) {
+      continue; // the device number
+    }
+    auto key = word.substr(0, eq);
+    if (out.contains(key)) {
+      out[key] = out[key].get<uint64_t>() + std::stoull(word.substr(eq + 1));
+    }
+  }
+  return out;
+}
+
+std::string cgroup_path(int pid) {
+  std::string buf;
+  auto proc = "/proc/" + std::to_string(pid);
+  int fd = open(proc.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return "";
+  }
+  bool ok = read_at(fd, "cgroup", buf);
+  close(fd);
+  if (!ok) {
+    return "";
+  }
+  std::istringstream in(buf);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.rfind("0::", 0) == 0) {
+      return line.substr(3);
+    }
+  }
+  return "";
+}
+
+nlohmann::json cgroup_metrics(const std::string &path) {
+  nlohmann::json out = nlohmann::json::object();
+  if (path.empty()) {
+    return out;
+  }
+  auto dir = std::string(cgroup2_root()) + path;
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return out;
+  }
+
+  std::string buf;
+  if (read_at(fd, "cpu.stat", buf)) {
+    out["cpu"] = flat_keyed(buf);
+  }
+  if (read_at(fd, "memory.current", buf)) {
+    out["memory"]["current"] = std::stoull(buf);
+    if (read_at(fd, "memory.peak", buf)) {
+      out["memory"]["peak"] = std::stoull(buf);
+    }
+  }
+  if (read_at(fd, "io.stat", buf)) {
+    out["io"] = io_totals(buf);
+  }
+  if (read_at(fd, "pids.current", buf)) {
+    out["pids"]["current"] = std::stoull(buf);
+  }
+  close(fd);
+  return out;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+
+#include "json.h"
+
+// The cgroup v2 path of a process relative to the cgroup2 mount, or an empty
+// string when the process isn't in a unified hierarchy
+std::string cgroup_path(int pid);
+
+// Live cpu, memory, io and pids metrics of a cgroup v2 group. Controllers
+// that aren't enabled for the group are left out.
+nlohmann::json cgroup_metrics(const std::string &path);
@@ -3,8 +3,11 @@
 #include <boost/filesystem.hpp>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
 
+#include "netlink.h"
+
 struct resolv_conf {
   std::vector<std::string> nameservers;
   std::vector<std::string> search;
@@ -16,10 +19,20 @@ struct Context {
   boost::filesystem::path var_lib;
 
   std::ostream *out_;
+  // Loaded on first use and shared by copies of the context. The daemon
+  // keeps its copy up to date from netlink notifications.
+  mutable std::shared_ptr<LinkInventory> links_;
 
   resolv_conf host_dns() const;
-  std::map<std::string, std::string> network_interfaces() const;
+  const LinkInventory &links() const;
   boost::filesystem::path volumes() const { return var_lib / "volumes"; }
+  // Shared by all apps
+  boost::filesystem::path layers() const {
+    return var_lib.parent_path() / "layers";
+  }
+  boost::filesystem::path seccomp_cache() const {
+    return var_lib.parent_path() / "seccomp";
+  }
 
   std::ostream &out() const { return *out_; }
 
@@ -0,0 +1,252 @@
+#include "daemon.h"
+
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "capp.h"
+#include "oci-hooks.h"
+#include "project.h"
+
+static const std::string compose_file = "docker-compose.json";
+
+static struct sockaddr_un socket_addr(const Context &ctx) {
+  auto path = (ctx.var_run / "daemon.sock").string();
+  struct sockaddr_un addr {};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + path);
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+static std::string read_all(int fd) {
+  std::string buf;
+  char chunk[4096];
+  while (true) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to read request");
+    } else if (n == 0) {
+      return buf;
+    }
+    buf.append(chunk, n);
+  }
+}
+
+static void write_all(int fd, const std::string &buf) {
+  size_t off = 0;
+  while (off < buf.size()) {
+    ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to write request");
+    }
+    off += n;
+  }
+}
+
+bool daemon_call(const Context &ctx, const nlohmann::json &req,
+                 nlohmann::json &resp) {
+  auto addr = socket_addr(ctx);
+  if (access(addr.sun_path, F_OK) != 0) {
+    return false;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    // A stale socket left behind by a daemon that's no longer running
+    close(fd);
+    return false;
+  }
+
+  std::string buf;
+  try {
+    write_all(fd, req.dump());
+    shutdown(fd, SHUT_WR);
+    buf = read_all(fd);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+
+  resp = nlohmann::json::parse(buf);
+  ctx.out() << resp["output"].get<std::string>();
+  if (resp.contains("error")) {
+    throw std::runtime_error(resp["error"].get<std::string>());
+  }
+  return true;
+}
+
+class Daemon {
+public:
+  Daemon(const std::string &app_name) : ctx_(Context::Load(app_name)) {
+    reload();
+  }
+  void serve();
+
+private:
+  std::shared_ptr<const ProjectDefinition> project();
+  void reload();
+  void handle(int fd);
+  void dispatch(const Context &ctx, const nlohmann::json &req,
+                nlohmann::json &resp);
+
+  Context ctx_;
+  std::mutex lock_;
+  std::shared_ptr<const ProjectDefinition> proj_;
+};
+
+std::shared_ptr<const ProjectDefinition> Daemon::project() {
+  std::lock_guard<std::mutex> guard(lock_);
+  return proj_;
+}
+
+void Daemon::reload() {
+  auto proj = std::make_shared<const ProjectDefinition>(
+      ProjectDefinition::Load(compose_file));
+  std::lock_guard<std::mutex> guard(lock_);
+  proj_ = proj;
+}
+
+void Daemon::dispatch(const Context &ctx, const nlohmann::json &req,
+                      nlohmann::json &resp) {
+  auto proj = project();
+  auto cmd = req["cmd"].get<std::string>();
+  if (cmd == "up") {
+    auto cfg = capp_prepare(ctx, *proj, req["service"].get<std::string>());
+    resp["config"] = cfg.config.string();
+    resp["rootfs"] = cfg.rootfs.string();
+    resp["spec_sha1"] = cfg.spec_sha1;
+    resp["restart"] = cfg.restart;
+  } else if (cmd == "createRuntime") {
+    oci_createRuntime(ctx, *proj, req["service"].get<std::string>(),
+                      req["state"].get<std::string>());
+  } else if (cmd == "poststop") {
+    oci_poststop(ctx, *proj, req["service"].get<std::string>());
+  } else if (cmd == "status") {
+    capp_status(ctx, *proj, req.value("json", false));
+  } else {
+    throw std::runtime_error("Unsupported request: " + cmd);
+  }
+}
+
+void Daemon::handle(int fd) {
+  std::stringstream out;
+  Context ctx = ctx_;
+  ctx.out_ = &out;
+
+  nlohmann::json resp;
+  try {
+    dispatch(ctx, nlohmann::json::parse(read_all(fd)), resp);
+  } catch (const std::exception &ex) {
+    resp["error"] = ex.what();
+  }
+  resp["output"] = out.str();
+  try {
+    write_all(fd, resp.dump());
+  } catch (const std::exception &ex) {
+    std::cerr << "Unable to send response: " << ex.what() << "\n";
+  }
+  close(fd);
+}
+
+void Daemon::serve() {
+  boost::filesystem::create_directories(ctx_.var_run);
+  auto addr = socket_addr(ctx_);
+  unlink(addr.sun_path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      chmod(addr.sun_path, S_IRUSR | S_IWUSR) != 0 || listen(sock, 64) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to listen on " +
+                                std::string(addr.sun_path));
+  }
+
+  // Watch the directory rather than the file as updates usually replace the
+  // compose file with a rename.
+  int notify = inotify_init1(IN_CLOEXEC);
+  if (notify < 0 ||
+      inotify_add_watch(notify, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to watch " + compose_file);
+  }
+
+  // Networks are created from requests, so keep the host's links at hand
+  // rather than dumping them each time.
+  ctx_.links_ = std::make_shared<LinkInventory>(true);
+
+  ctx_.out() << "Listening on " << addr.sun_path << std::endl;
+  struct pollfd fds[3] = {
+      {sock, POLLIN, 0}, {notify, POLLIN, 0}, {ctx_.links_->fd(), POLLIN, 0}};
+  while (true) {
+    if (poll(fds, 3, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to poll for requests");
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char buf[4096]
+          __attribute__((aligned(__alignof__(struct inotify_event))));
+      ssize_t len = read(notify, buf, sizeof(buf));
+      bool changed = false;
+      for (char *ptr = buf; len > 0 && ptr < buf + len;) {
+        auto *ev = (struct inotify_event *)ptr;
+        if (ev->len > 0 && compose_file == ev->name) {
+          changed = true;
+        }
+        ptr += sizeof(struct inotify_event) + ev->len;
+      }
+      if (changed) {
+        ctx_.out() << "Reloading " << compose_file << std::endl;
+        try {
+          reload();
+        } catch (const std::exception &ex) {
+          ctx_.out() << "Unable to reload, keeping previous project: "
+                     << ex.what() << std::endl;
+        }
+      }
+    }
+
+    if (fds[2].revents & POLLIN) {
+      try {
+        ctx_.links_->update();
+      } catch (const std::exception &ex) {
+        ctx_.out() << "Unable to update network interfaces: " << ex.what()
+                   << std::endl;
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        continue;
+      }
+      std::thread(&Daemon::handle, this, fd).detach();
+    }
+  }
+}
+
+void capp_daemon(const std::string &app_name) {
+  Daemon daemon(app_name);
+  daemon.serve();
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "json.h"
+
+#include "context.h"
+
+// Serve up/hook/status requests for an app over a unix socket so the compose
+// project is only parsed when it changes rather than once per request.
+void capp_daemon(const std::string &app_name);
+
+// Send a request to the app's daemon. Returns false when no daemon is running
+// so the caller can handle the request in-process. The request's output is
+// written to ctx.out() and failures are rethrown as exceptions.
+bool daemon_call(const Context &ctx, const nlohmann::json &req,
+                 nlohmann::json &resp);
@@ -0,0 +1,78 @@
+#include "firewall.h"
+
+#include <boost/process.hpp>
+
+#include "utils.h"
+
+void FirewallRules::add(const std::string &table, const std::string &chain,
+                        const std::string &rule) {
+  tables_[table].emplace_back("-A " + chain + " " + rule);
+}
+
+std::string FirewallRules::render(bool remove) const {
+  std::string out;
+  for (const auto &it : tables_) {
+    out += "*" + it.first + "\n";
+    for (const auto &line : it.second) {
+      if (remove) {
+        out += "-D" + line.substr(2) + "\n";
+      } else {
+        out += line + "\n";
+      }
+    }
+    out += "COMMIT\n";
+  }
+  return out;
+}
+
+void FirewallRules::restore(const std::string &input) const {
+  namespace bp = boost::process;
+  bp::opstream in;
+  bp::ipstream out;
+  bp::child c(bp::search_path("iptables-restore"), "--wait", "--noflush",
+              bp::std_in < in, (bp::std_out & bp::std_err) > out);
+  in << input;
+  in.flush();
+  in.pipe().close();
+
+  std::string line;
+  std::string errors;
+  while (std::getline(out, line)) {
+    errors += line + "\n";
+  }
+  c.wait();
+  if (c.exit_code() != 0) {
+    throw std::runtime_error("Unable to apply firewall rules: " + errors);
+  }
+}
+
+void FirewallRules::apply() const {
+  if (!empty()) {
+    restore(render());
+  }
+}
+
+void FirewallRules::remove() const {
+  if (!empty()) {
+    restore(render(true));
+  }
+}
+
+void FirewallRules::save(const boost::filesystem::path &path) const {
+  open_write(path) << render();
+}
+
+FirewallRules FirewallRules::Load(const boost::filesystem::path &path) {
+  FirewallRules rules;
+  auto f = open_read(path);
+  std::string table;
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.size() > 1 && line[0] == '*') {
+      table = line.substr(1);
+    } else if (line.rfind("-A ", 0) == 0 && !table.empty()) {
+      rules.tables_[table].emplace_back(line);
+    }
+  }
+  return rules;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <map>
+#include <string>
+#include <vector>
+
+// A set of iptables rules that is committed with a single
+// `iptables-restore --noflush` so that each table is updated atomically
+// rather than reloading the ruleset once per rule.
+class FirewallRules {
+public:
+  void add(const std::string &table, const std::string &chain,
+           const std::string &rule);
+  bool empty() const { return tables_.empty(); }
+
+  // The iptables-restore input that appends(or deletes) the rules
+  std::string render(bool remove = false) const;
+
+  void apply() const;
+  void remove() const;
+
+  // Rules are saved in iptables-restore format so they can be reviewed and
+  // replayed by hand.
+  void save(const boost::filesystem::path &path) const;
+  static FirewallRules Load(const boost::filesystem::path &path);
+
+private:
+  void restore(const std::string &input) const;
+
+  // table -> "-A <chain> <rule>" lines
+  std::map<std::string, std::vector<std::string>> tables_;
+};
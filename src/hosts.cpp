@@ -0,0 +1,107 @@
+#include "hosts.h"
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+
+#include "json.h"
+
+// Owns the entries of a hosts file written before the index existed. Not a
+// valid service name so it can't clash with one.
+static const std::string unknown_owner = "(unknown)";
+
+HostsTable::HostsTable(const boost::filesystem::path &path)
+    : index_(path.string() + ".index"), file_(path) {
+  content_ = file_.read();
+  if (!boost::filesystem::exists(index_)) {
+    // Keep the entries of services that are already running until they're
+    // replaced by ones with an owner
+    std::istringstream lines(content_);
+    std::string line;
+    while (std::getline(lines, line)) {
+      std::istringstream fields(line);
+      std::string ip, host;
+      fields >> ip;
+      if (ip.empty() || ip[0] == '#') {
+        continue;
+      }
+      while (fields >> host) {
+        if (host != "localhost") {
+          services_[unknown_owner].push_back({ip, host});
+        }
+      }
+    }
+    return;
+  }
+  nlohmann::json data;
+  open_read(index_) >> data;
+  index_content_ = data.dump();
+  for (const auto &it : data.items()) {
+    auto &entries = services_[it.key()];
+    for (const auto &entry : it.value()) {
+      entries.push_back({entry[0].get<std::string>(),
+                         entry[1].get<std::string>()});
+    }
+  }
+}
+
+void HostsTable::set(const std::string &service,
+                     const std::vector<host_entry> &entries) {
+  // An unowned entry for the service, or for one of its hosts, is its own
+  auto unknown = services_.find(unknown_owner);
+  if (unknown != services_.end()) {
+    auto &prev = unknown->second;
+    prev.erase(std::remove_if(prev.begin(), prev.end(),
+                              [&service, &entries](const host_entry &e) {
+                                if (e.host == service) {
+                                  return true;
+                                }
+                                for (const auto &entry : entries) {
+                                  if (e.host == entry.host) {
+                                    return true;
+                                  }
+                                }
+                                return false;
+                              }),
+               prev.end());
+    if (prev.empty()) {
+      services_.erase(unknown);
+    }
+  }
+  if (entries.empty()) {
+    services_.erase(service);
+  } else {
+    services_[service] = entries;
+  }
+}
+
+void HostsTable::save() {
+  std::string content = "127.0.0.1\tlocalhost\n";
+  std::set<std::string> seen;
+  nlohmann::json data = nlohmann::json::object();
+  for (const auto &it : services_) {
+    auto &entries = data[it.first];
+    entries = nlohmann::json::array();
+    for (const auto &entry : it.second) {
+      entries.push_back({entry.ip, entry.host});
+      // Services may share extra_hosts
+      auto line = entry.ip + "\t" + entry.host + "\n";
+      if (seen.insert(line).second) {
+        content += line;
+      }
+    }
+  }
+
+  // The lock is held on the hosts file so the index can be replaced
+  auto index = data.dump();
+  if (index != index_content_) {
+    auto tmp = index_.string() + ".tmp";
+    open_write(tmp) << index;
+    boost::filesystem::rename(tmp, index_);
+    index_content_ = index;
+  }
+  if (content != content_) {
+    file_.write(content);
+    content_ = content;
+  }
+}
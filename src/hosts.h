@@ -0,0 +1,35 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+struct host_entry {
+  std::string ip;
+  std::string host;
+};
+
+// The /etc/hosts shared by an app's containers. Entries are indexed by the
+// service that added them, kept in "<path>.index", so a service's entries
+// are replaced or removed together. The file is bind mounted into running
+// containers, so it's rewritten in place rather than replaced with a rename,
+// and only when its content changes.
+class HostsTable {
+public:
+  // Locks the table until destroyed
+  HostsTable(const boost::filesystem::path &path);
+
+  // Replace the entries of `service`, or remove them if `entries` is empty
+  void set(const std::string &service, const std::vector<host_entry> &entries);
+  void save();
+
+private:
+  boost::filesystem::path index_;
+  LockedFile file_;
+  std::string content_;
+  std::string index_content_;
+  std::map<std::string, std::vector<host_entry>> services_;
+};
@@ -0,0 +1,368 @@
+#include "image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "json.h"
+
+#include "layers.h"
+#include "registry.h"
+#include "utils.h"
+
+#ifndef DOCKER_ARCH
+#error Missing DOCKER_ARCH
+#endif
+
+static boost::filesystem::path image_record(const Context &ctx,
+                                            const std::string &svc) {
+  return ctx.var_lib / "images" / (svc + ".json");
+}
+
+// The image record of the last pull if all of its layers are still present
+static nlohmann::json current_image(const Context &ctx, const std::string &svc,
+                                    const LayerStore &store) {
+  auto record = image_record(ctx, svc);
+  if (!boost::filesystem::exists(record)) {
+    return nullptr;
+  }
+  nlohmann::json data;
+  try {
+    open_read(record) >> data;
+    for (const auto &digest : data["layers"]) {
+      if (!store.has(digest.get<std::string>())) {
+        return nullptr;
+      }
+    }
+  } catch (const std::exception &ex) {
+    return nullptr;
+  }
+  return data;
+}
+
+static void write_record(const Context &ctx, const std::string &svc,
+                         const std::string &image,
+                         const ImageManifest &manifest) {
+  nlohmann::json data;
+  data["image"] = image;
+  data["manifest"] = manifest.digest;
+  data["layers"] = nlohmann::json::array();
+  for (const auto &l : manifest.layers) {
+    data["layers"].push_back(l.digest);
+  }
+  auto record = image_record(ctx, svc);
+  boost::filesystem::create_directories(record.parent_path());
+  auto tmp = record.string() + ".tmp";
+  open_write(tmp) << data;
+  boost::filesystem::rename(tmp, record);
+}
+
+// Run fn(0..count-1) on up to `jobs` threads, returning what each threw
+static std::vector<std::exception_ptr>
+parallel_for(size_t count, size_t jobs,
+             const std::function<void(size_t)> &fn) {
+  std::vector<std::exception_ptr> errors(count);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t idx = next++; idx < count; idx = next++) {
+      try {
+        fn(idx);
+      } catch (...) {
+        errors[idx] = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < std::min(std::max<size_t>(jobs, 1), count); i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  return errors;
+}
+
+static std::string what(const std::exception_ptr &err) {
+  try {
+    std::rethrow_exception(err);
+  } catch (const std::exception &ex) {
+    return ex.what();
+  }
+}
+
+// One image being pulled for one or more services
+struct pull_job {
+  std::string image;
+  std::string label; // the services using it
+  std::vector<std::string> services;
+  std::unique_ptr<ImageSource> src;
+  ImageManifest manifest;
+  bool up_to_date;
+  std::string error;
+
+  size_t layers_total;
+  size_t layers_done;
+  uint64_t bytes_total;
+  uint64_t bytes_done;
+  uint64_t skipped_bytes;
+};
+
+// Reports the combined progress of every image being pulled
+class PullProgress {
+public:
+  PullProgress(const Context &ctx, std::vector<pull_job> &jobs)
+      : ctx_(ctx), jobs_(jobs), last_(std::chrono::steady_clock::now()) {}
+
+  void data(const std::vector<size_t> &jobs, size_t len) {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto idx : jobs) {
+      jobs_[idx].bytes_done += len;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_ >= std::chrono::seconds(1)) {
+      last_ = now;
+      for (const auto &job : jobs_) {
+        if (!job.up_to_date && job.layers_done < job.layers_total) {
+          report(job);
+        }
+      }
+    }
+  }
+
+  void layer_done(const std::vector<size_t> &jobs) {
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto idx : jobs) {
+      jobs_[idx].layers_done++;
+      report(jobs_[idx]);
+    }
+  }
+
+private:
+  void report(const pull_job &job) {
+    ctx_.out() << job.label << ": " << job.layers_done << "/"
+               << job.layers_total << " layers, " << job.bytes_done << "/"
+               << job.bytes_total << " bytes\n";
+    ctx_.out().flush();
+  }
+
+  const Context &ctx_;
+  std::vector<pull_job> &jobs_;
+  std::mutex lock_;
+  std::chrono::steady_clock::time_point last_;
+};
+
+// A layer needed by one or more of the images
+struct layer_task {
+  Layer layer;
+  ImageSource *src;
+  std::vector<size_t> jobs;
+};
+
+void image_pull(const Context &ctx, const std::vector<Service> &services,
+                size_t jobs) {
+  LayerStore store(ctx.layers());
+
+  // Services using the same image only pull it once
+  std::vector<pull_job> pulls;
+  for (const auto &svc : services) {
+    auto it = std::find_if(pulls.begin(), pulls.end(), [&svc](pull_job &p) {
+      return p.image == svc.image;
+    });
+    if (it == pulls.end()) {
+      pulls.emplace_back();
+      it = pulls.end() - 1;
+      it->image = svc.image;
+      it->up_to_date = false;
+    } else {
+      it->label += ", ";
+    }
+    it->label += svc.name;
+    it->services.emplace_back(svc.name);
+  }
+
+  for (auto &job : pulls) {
+    ctx.out() << "Pulling " << job.label << ": " << job.image << "\n";
+    // An image pinned by digest can't have changed, so skip the registry
+    if (job.image.find('@') == std::string::npos) {
+      continue;
+    }
+    for (const auto &svc : job.services) {
+      auto current = current_image(ctx, svc, store);
+      if (current.is_object() && current["image"] == job.image) {
+        job.manifest.digest = current["manifest"];
+        for (const auto &digest : current["layers"]) {
+          job.manifest.layers.push_back({digest.get<std::string>(), "", 0});
+        }
+        job.up_to_date = true;
+        break;
+      }
+    }
+  }
+
+  auto errors = parallel_for(pulls.size(), jobs, [&](size_t idx) {
+    auto &job = pulls[idx];
+    if (job.up_to_date) {
+      return;
+    }
+    job.src = ImageSource::Create(job.image);
+    job.manifest = job.src->manifest(DOCKER_ARCH);
+    job.up_to_date = true;
+    for (const auto &svc : job.services) {
+      auto current = current_image(ctx, svc, store);
+      if (!current.is_object() || current["image"] != job.image ||
+          current["manifest"] != job.manifest.digest) {
+        job.up_to_date = false;
+      }
+    }
+  });
+
+  // Work out which layers are missing. Each is fetched once even if several
+  // images share it.
+  std::vector<layer_task> tasks;
+  for (size_t idx = 0; idx < pulls.size(); idx++) {
+    auto &job = pulls[idx];
+    if (errors[idx]) {
+      job.error = what(errors[idx]);
+      continue;
+    }
+    job.layers_total = job.layers_done = 0;
+    job.bytes_total = job.bytes_done = job.skipped_bytes = 0;
+    if (job.up_to_date) {
+      continue;
+    }
+    for (const auto &l : job.manifest.layers) {
+      if (store.has(l.digest)) {
+        job.skipped_bytes += l.size;
+        continue;
+      }
+      job.layers_total++;
+      job.bytes_total += l.size;
+      auto it = std::find_if(tasks.begin(), tasks.end(), [&l](layer_task &t) {
+        return t.layer.digest == l.digest;
+      });
+      if (it == tasks.end()) {
+        tasks.push_back({l, job.src.get(), {}});
+        it = tasks.end() - 1;
+      }
+      it->jobs.emplace_back(idx);
+    }
+  }
+
+  PullProgress progress(ctx, pulls);
+  errors = parallel_for(tasks.size(), jobs, [&](size_t idx) {
+    const auto &t = tasks[idx];
+    auto blob = store.blob_path(t.layer.digest);
+    try {
+      t.src->fetch_blob(t.layer, blob,
+                        [&](size_t len) { progress.data(t.jobs, len); });
+      store.add(t.layer.digest, blob);
+    } catch (...) {
+      boost::filesystem::remove(blob);
+      throw;
+    }
+    boost::filesystem::remove(blob);
+    progress.layer_done(t.jobs);
+  });
+  for (size_t idx = 0; idx < tasks.size(); idx++) {
+    if (errors[idx]) {
+      for (auto job : tasks[idx].jobs) {
+        pulls[job].error = what(errors[idx]);
+      }
+    }
+  }
+
+  std::string failed;
+  for (const auto &job : pulls) {
+    if (!job.error.empty()) {
+      ctx.out() << job.label << ": " << job.error << "\n";
+      failed += failed.empty() ? job.label : ", " + job.label;
+      continue;
+    }
+    if (job.up_to_date) {
+      ctx.out() << job.label << ": Image is up to date\n";
+    } else {
+      ctx.out() << job.label << ": Fetched " << job.layers_total
+                << " layers (" << job.bytes_total << " bytes), skipped "
+                << job.manifest.layers.size() - job.layers_total
+                << " already present (" << job.skipped_bytes << " bytes)\n";
+    }
+    for (const auto &svc : job.services) {
+      write_record(ctx, svc, job.image, job.manifest);
+    }
+  }
+  if (!failed.empty()) {
+    throw std::runtime_error("Unable to pull images for: " + failed);
+  }
+}
+
+std::vector<boost::filesystem::path> image_layers(const Context &ctx,
+                                                  const std::string &svc) {
+  std::vector<boost::filesystem::path> lower;
+  auto record = image_record(ctx, svc);
+  if (boost::filesystem::exists(record)) {
+    nlohmann::json data;
+    open_read(record) >> data;
+    LayerStore store(ctx.layers());
+    for (const auto &digest : data["layers"]) {
+      auto path = store.path(digest.get<std::string>());
+      if (!boost::filesystem::is_directory(path)) {
+        throw std::runtime_error("Missing layer " + digest.get<std::string>() +
+                                 " for service");
+      }
+      lower.insert(lower.begin(), path);
+    }
+  } else if (boost::filesystem::is_directory(ctx.var_lib / "images" / svc)) {
+    lower.emplace_back(ctx.var_lib / "images" / svc);
+  }
+  if (lower.empty()) {
+    throw std::runtime_error("Could not find image for service");
+  }
+  return lower;
+}
+
+// Layers used by any app's image records and the lowerdirs of its mounts
+static std::set<std::string> referenced_layers(const Context &ctx) {
+  std::set<std::string> used;
+  auto lib = ctx.var_lib.parent_path();
+  for (auto &app : boost::filesystem::directory_iterator(lib)) {
+    auto images = app.path() / "images";
+    if (boost::filesystem::is_directory(images)) {
+      for (auto &f : boost::filesystem::directory_iterator(images)) {
+        if (f.path().extension() == ".json") {
+          nlohmann::json data;
+          open_read(f.path()) >> data;
+          for (const auto &digest : data["layers"]) {
+            used.insert(digest.get<std::string>());
+          }
+        }
+      }
+    }
+    auto mounts = app.path() / "mounts";
+    if (boost::filesystem::is_directory(mounts)) {
+      for (auto &m : boost::filesystem::directory_iterator(mounts)) {
+        auto lower = m.path() / ".lower";
+        if (boost::filesystem::exists(lower)) {
+          auto f = open_read(lower);
+          std::string line;
+          while (std::getline(f, line)) {
+            used.insert("sha256:" +
+                        boost::filesystem::path(line).filename().string());
+          }
+        }
+      }
+    }
+  }
+  return used;
+}
+
+void image_prune(const Context &ctx) {
+  LayerStore store(ctx.layers());
+  auto removed = store.prune([&ctx]() { return referenced_layers(ctx); });
+  if (removed > 0) {
+    ctx.out() << "Removed " << removed << " unused layers\n";
+  }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <string>
+#include <vector>
+
+#include "context.h"
+#include "project.h"
+
+// Pull the services' images straight from their registry (or OCI layout)
+// into the shared layer store. Each distinct image and layer is fetched once,
+// with up to `jobs` downloads at a time, and each service's layer stack is
+// recorded in images/<svc>.json.
+void image_pull(const Context &ctx, const std::vector<Service> &services,
+                size_t jobs);
+
+// The overlay lowerdirs of a service's image, top-most layer first
+std::vector<boost::filesystem::path> image_layers(const Context &ctx,
+                                                  const std::string &svc);
+
+// Remove layers no longer referenced by any app's images or mounts
+void image_prune(const Context &ctx);
@@ -0,0 +1,417 @@
+#include "ipam.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+static const char magic[8] = {'c', 'a', 'p', 'p', 'i', 'p', '2', '\0'};
+static const size_t max_slots = 65536;
+// A host name, nul padded, per address. DNS labels are at most 63 characters.
+static const size_t host_record_size = 64;
+// "<app>/<network>" per subnet
+static const size_t network_record_size = 128;
+// Keeps the interface names derived from a subnet's index within IFNAMSIZ
+static const size_t max_subnets = 1 << 20;
+
+struct header {
+  char magic[8];
+  uint32_t slots;
+  uint32_t record_size;
+  char id[48];
+};
+
+// The file is the header, the bitmap of used slots, then the records
+static const off_t bitmap_offset = sizeof(header);
+
+struct LeaseTable::Slot {
+  size_t index; // SIZE_MAX if there's none free
+  bool used;
+  bool found; // the slot holds the name's record
+  // Never used slots passed over because they weren't usable
+  std::vector<size_t> skipped;
+};
+
+// Left in a slot that was skipped so lookups keep probing past it
+static const char skipped_record = '\x01';
+
+// Holds an exclusive flock on the table while in scope
+class TableLock {
+public:
+  explicit TableLock(int fd) : fd_(fd) {
+    if (flock(fd_, LOCK_EX) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to lock lease table");
+    }
+  }
+  ~TableLock() { flock(fd_, LOCK_UN); }
+
+private:
+  int fd_;
+};
+
+Subnet Subnet::Parse(const std::string &cidr) {
+  Subnet s{};
+  auto slash = cidr.find('/');
+  auto ip = cidr.substr(0, slash);
+  if (inet_pton(AF_INET, ip.c_str(), s.base) == 1) {
+    s.family = AF_INET;
+  } else if (inet_pton(AF_INET6, ip.c_str(), s.base) == 1) {
+    s.family = AF_INET6;
+  } else {
+    throw std::runtime_error("Invalid subnet: " + cidr);
+  }
+  s.prefixlen = slash == std::string::npos ? s.bits() : atoi(&cidr[slash + 1]);
+  // Room for at least the gateway and a host
+  if (s.prefixlen <= 0 || s.prefixlen > s.bits() - 2) {
+    throw std::runtime_error("Invalid subnet size: " + cidr);
+  }
+  for (int i = s.prefixlen; i < s.bits(); i++) {
+    s.base[i / 8] &= ~(0x80 >> (i % 8));
+  }
+  return s;
+}
+
+std::string Subnet::address(uint64_t offset) const {
+  unsigned char addr[16];
+  memcpy(addr, base, sizeof(addr));
+  for (int i = bits() / 8 - 1; i >= 0 && offset > 0; i--) {
+    offset += addr[i];
+    addr[i] = offset & 0xff;
+    offset >>= 8;
+  }
+  char buf[INET6_ADDRSTRLEN];
+  inet_ntop(family, addr, buf, sizeof(buf));
+  return buf;
+}
+
+bool Subnet::contains(const std::string &ip) const {
+  unsigned char addr[16];
+  if (inet_pton(family, ip.c_str(), addr) != 1) {
+    return false;
+  }
+  for (int i = 0; i < prefixlen; i++) {
+    unsigned char mask = 0x80 >> (i % 8);
+    if ((addr[i / 8] & mask) != (base[i / 8] & mask)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void pread_all(int fd, void *buf, size_t len, off_t off) {
+  if (pread(fd, buf, len, off) != (ssize_t)len) {
+    throw std::runtime_error("Unable to read lease table");
+  }
+}
+
+static void pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+  if (pwrite(fd, buf, len, off) != (ssize_t)len) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to update lease table");
+  }
+}
+
+// FNV-1a
+static uint64_t hash(const std::string &name) {
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char c : name) {
+    h = (h ^ c) * 1099511628211ULL;
+  }
+  return h;
+}
+
+LeaseTable::LeaseTable(const boost::filesystem::path &path,
+                       const std::string &id, size_t slots,
+                       size_t record_size, const std::vector<size_t> &reserved)
+    : slots_(slots), record_size_(record_size) {
+  struct header hdr {};
+  if (id.size() >= sizeof(hdr.id)) {
+    throw std::runtime_error("Invalid lease table id: " + id);
+  }
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to open " + path.string());
+  }
+  try {
+    TableLock lock(fd_);
+    if (pread(fd_, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.magic[0] != '\0') {
+      if (memcmp(hdr.magic, magic, sizeof(magic)) != 0) {
+        throw std::runtime_error("Invalid lease table " + path.string());
+      }
+      if (strncmp(hdr.id, id.c_str(), sizeof(hdr.id)) != 0 ||
+          hdr.slots != slots_ || hdr.record_size != record_size_) {
+        throw std::runtime_error("Lease table " + path.string() + " is for " +
+                                 hdr.id + " rather than " + id);
+      }
+      return;
+    }
+
+    // The header goes last so a table is only used once it's complete
+    if (ftruncate(fd_, record_offset(slots_)) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to create lease table");
+    }
+    for (auto slot : reserved) {
+      set_bit(slot, true);
+    }
+    memcpy(hdr.magic, magic, sizeof(magic));
+    hdr.slots = slots_;
+    hdr.record_size = record_size_;
+    memcpy(hdr.id, id.data(), id.size());
+    pwrite_all(fd_, &hdr, sizeof(hdr), 0);
+  } catch (...) {
+    close(fd_);
+    throw;
+  }
+}
+
+LeaseTable::~LeaseTable() { close(fd_); }
+
+off_t LeaseTable::record_offset(size_t slot) const {
+  return bitmap_offset + ((slots_ + 63) / 64) * 8 + slot * record_size_;
+}
+
+uint64_t LeaseTable::read_word(size_t slot) {
+  uint64_t word;
+  pread_all(fd_, &word, sizeof(word), bitmap_offset + (slot / 64) * 8);
+  return word;
+}
+
+void LeaseTable::set_bit(size_t slot, bool val) {
+  uint64_t word = read_word(slot);
+  uint64_t bit = 1ULL << (slot % 64);
+  word = val ? word | bit : word & ~bit;
+  pwrite_all(fd_, &word, sizeof(word), bitmap_offset + (slot / 64) * 8);
+}
+
+// Probe from the name's hash for its record, or else the first free slot. A
+// slot that was never used ends the search as the name would have been
+// placed there.
+LeaseTable::Slot
+LeaseTable::find(const std::string &name,
+                 const std::function<bool(size_t)> &usable) {
+  Slot free{SIZE_MAX, false, false, {}};
+  uint64_t start = hash(name);
+  std::vector<char> record(record_size_);
+  for (size_t i = 0; i < slots_; i++) {
+    size_t slot = (start + i) % slots_;
+    bool used = (read_word(slot) >> (slot % 64)) & 1;
+    pread_all(fd_, record.data(), record.size(), record_offset(slot));
+    if (strncmp(record.data(), name.c_str(), record.size()) == 0) {
+      return {slot, used, true, {}};
+    }
+    bool never_used = !used && record[0] == '\0';
+    if (!used && free.index == SIZE_MAX) {
+      if (!usable || usable(slot)) {
+        free.index = slot;
+      } else if (never_used) {
+        free.skipped.push_back(slot);
+      }
+    }
+    if (never_used && free.index != SIZE_MAX) {
+      break;
+    }
+  }
+  return free;
+}
+
+size_t LeaseTable::acquire(const std::string &name,
+                           const std::function<bool(size_t)> &usable,
+                           bool existing_only) {
+  if (name.empty() || name.size() >= record_size_) {
+    throw std::runtime_error("Invalid name for lease: " + name);
+  }
+  TableLock lock(fd_);
+  auto slot = find(name, usable);
+  if (slot.index == SIZE_MAX || (existing_only && !slot.found)) {
+    return SIZE_MAX;
+  }
+  if (!slot.found) {
+    for (auto skipped : slot.skipped) {
+      pwrite_all(fd_, &skipped_record, 1, record_offset(skipped));
+    }
+    std::vector<char> record(record_size_);
+    memcpy(record.data(), name.data(), name.size());
+    pwrite_all(fd_, record.data(), record.size(), record_offset(slot.index));
+  }
+  if (!slot.used) {
+    set_bit(slot.index, true);
+  }
+  return slot.index;
+}
+
+bool LeaseTable::release(const std::string &name) {
+  TableLock lock(fd_);
+  auto slot = find(name, nullptr);
+  if (!slot.found || !slot.used) {
+    return false;
+  }
+  // The record stays so the name can get the same slot back
+  set_bit(slot.index, false);
+  return true;
+}
+
+static size_t host_slots(const Subnet &subnet) {
+  int host_bits = subnet.bits() - subnet.prefixlen;
+  return host_bits >= 16 ? max_slots : (size_t)1 << host_bits;
+}
+
+static std::vector<size_t> host_reserved(const Subnet &subnet) {
+  // The network and the gateway
+  std::vector<size_t> reserved{0, 1};
+  if (subnet.family == AF_INET && subnet.prefixlen >= 16) {
+    reserved.push_back(host_slots(subnet) - 1); // broadcast
+  }
+  return reserved;
+}
+
+Ipam::Ipam(const boost::filesystem::path &path, const std::string &subnet)
+    : subnet_(Subnet::Parse(subnet)),
+      table_(path, subnet_.str(), host_slots(subnet_), host_record_size,
+             host_reserved(subnet_)) {}
+
+std::string Ipam::acquire(const std::string &host, size_t *index) {
+  auto slot = table_.acquire(host);
+  if (slot == SIZE_MAX) {
+    throw std::runtime_error("Unable to find an available IP in network");
+  }
+  if (index != nullptr) {
+    *index = slot;
+  }
+  return subnet_.address(slot);
+}
+
+bool Ipam::release(const std::string &host) { return table_.release(host); }
+
+struct pool {
+  Subnet base;
+  int size; // prefix length of the subnets handed out
+  size_t slots;
+  size_t first; // index of the pool's first subnet among all pools
+
+  Subnet subnet(size_t slot) const {
+    Subnet s = base;
+    s.prefixlen = size;
+    // The slot shifted into the bits between the pool's prefix and `size`
+    int bit = size - 1;
+    for (; slot > 0; slot >>= 1, bit--) {
+      if (slot & 1) {
+        s.base[bit / 8] |= 0x80 >> (bit % 8);
+      }
+    }
+    return s;
+  }
+};
+
+// CAPPRUN_NET_POOLS is a space or comma separated list of <cidr>:<size>
+// entries. Each is carved into subnets with a prefix length of <size>.
+static std::vector<pool> load_pools() {
+  const char *env = getenv("CAPPRUN_NET_POOLS");
+  std::string spec = env != nullptr ? env : "172.42.0.0/16:24";
+  std::vector<pool> pools;
+  size_t total = 0;
+  size_t pos = 0;
+  while (pos < spec.size()) {
+    auto end = spec.find_first_of(", ", pos);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    auto entry = spec.substr(pos, end - pos);
+    pos = end + 1;
+    if (entry.empty()) {
+      continue;
+    }
+    auto colon = entry.rfind(':');
+    auto slash = entry.find('/');
+    if (colon == std::string::npos || slash == std::string::npos ||
+        colon < slash) {
+      throw std::runtime_error("Invalid CAPPRUN_NET_POOLS entry: " + entry);
+    }
+    pool p{};
+    p.base = Subnet::Parse(entry.substr(0, colon));
+    // The firewall rules are only written for iptables
+    if (p.base.family != AF_INET) {
+      throw std::runtime_error("Only IPv4 pools are supported: " + entry);
+    }
+    p.size = atoi(&entry[colon + 1]);
+    if (p.size < p.base.prefixlen || p.size > p.base.bits() - 2) {
+      throw std::runtime_error("Invalid subnet size in CAPPRUN_NET_POOLS: " +
+                               entry);
+    }
+    int subnet_bits = p.size - p.base.prefixlen;
+    p.slots = subnet_bits >= 16 ? max_slots : (size_t)1 << subnet_bits;
+    p.first = total;
+    total += p.slots;
+    pools.push_back(p);
+  }
+  if (pools.empty()) {
+    throw std::runtime_error("No subnets configured in CAPPRUN_NET_POOLS");
+  }
+  if (total > max_subnets) {
+    throw std::runtime_error("CAPPRUN_NET_POOLS has more than " +
+                             std::to_string(max_subnets) + " subnets");
+  }
+  return pools;
+}
+
+static std::vector<std::unique_ptr<LeaseTable>>
+pool_tables(const boost::filesystem::path &dir,
+            const std::vector<pool> &pools) {
+  boost::filesystem::create_directories(dir);
+  std::vector<std::unique_ptr<LeaseTable>> tables;
+  for (const auto &p : pools) {
+    auto id = p.base.str() + ":" + std::to_string(p.size);
+    auto fname = id;
+    std::replace_if(
+        fname.begin(), fname.end(), [](char c) { return c == '/' || c == ':'; },
+        '_');
+    tables.emplace_back(
+        new LeaseTable(dir / fname, id, p.slots, network_record_size, {}));
+  }
+  return tables;
+}
+
+SubnetLease subnet_acquire(const boost::filesystem::path &dir,
+                           const std::string &name,
+                           const std::vector<std::string> &host_addrs) {
+  auto pools = load_pools();
+  auto tables = pool_tables(dir, pools);
+
+  // A network keeps the subnet it had before, even if it's in a later pool
+  for (size_t i = 0; i < pools.size(); i++) {
+    auto slot = tables[i]->acquire(name, nullptr, true);
+    if (slot != SIZE_MAX) {
+      return {pools[i].subnet(slot), pools[i].first + slot};
+    }
+  }
+  for (size_t i = 0; i < pools.size(); i++) {
+    const auto &p = pools[i];
+    auto slot = tables[i]->acquire(name, [&p, &host_addrs](size_t slot) {
+      auto subnet = p.subnet(slot);
+      for (const auto &addr : host_addrs) {
+        if (subnet.contains(addr)) {
+          return false;
+        }
+      }
+      return true;
+    });
+    if (slot != SIZE_MAX) {
+      return {p.subnet(slot), p.first + slot};
+    }
+  }
+  throw std::runtime_error("Unable to find an available subnet");
+}
+
+bool subnet_release(const boost::filesystem::path &dir,
+                    const std::string &name) {
+  bool released = false;
+  for (auto &table : pool_tables(dir, load_pools())) {
+    released |= table->release(name);
+  }
+  return released;
+}
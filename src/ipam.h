@@ -0,0 +1,99 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <functional>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+struct Subnet {
+  int family;
+  unsigned char base[16];
+  int prefixlen;
+
+  // "172.42.1.0/24" or "fd00:42::/64". Host bits are cleared.
+  static Subnet Parse(const std::string &cidr);
+  int bits() const { return family == AF_INET ? 32 : 128; }
+  // The address `offset` addresses into the subnet
+  std::string address(uint64_t offset) const;
+  bool contains(const std::string &ip) const;
+  std::string str() const {
+    return address(0) + "/" + std::to_string(prefixlen);
+  }
+};
+
+// A file of `slots` leases, each held by a name, shared by every process
+// using it. The table has an occupancy bitmap and a fixed size record per
+// slot. Names are placed by a hash so acquiring or releasing a lease touches
+// a couple of records rather than the whole table. A released lease keeps its
+// name, so whoever comes back gets the same slot unless someone else needed
+// it in the meantime. Updates are ordered so a crash never leaves a slot
+// owned by two names.
+class LeaseTable {
+public:
+  // Open the table at `path`, creating it if it doesn't exist yet. `id`
+  // says what the slots are for and must match the existing table's.
+  LeaseTable(const boost::filesystem::path &path, const std::string &id,
+             size_t slots, size_t record_size,
+             const std::vector<size_t> &reserved);
+  ~LeaseTable();
+  LeaseTable(const LeaseTable &) = delete;
+  LeaseTable &operator=(const LeaseTable &) = delete;
+
+  // The slot leased to `name`, allocating one for which `usable` is true if
+  // it has none, unless `existing_only`. SIZE_MAX if there's none to give.
+  size_t acquire(const std::string &name,
+                 const std::function<bool(size_t)> &usable = nullptr,
+                 bool existing_only = false);
+  // Returns false if `name` had no lease
+  bool release(const std::string &name);
+
+private:
+  struct Slot;
+  Slot find(const std::string &name, const std::function<bool(size_t)> &usable);
+  uint64_t read_word(size_t slot);
+  void set_bit(size_t slot, bool val);
+  off_t record_offset(size_t slot) const;
+
+  int fd_;
+  size_t slots_;
+  size_t record_size_;
+};
+
+// The address leases of one network's subnet. Subnets larger than 65536
+// addresses only use the first 65536.
+class Ipam {
+public:
+  Ipam(const boost::filesystem::path &path, const std::string &subnet);
+
+  int prefixlen() const { return subnet_.prefixlen; }
+  // The first address, reserved for the bridge
+  std::string gateway() const { return subnet_.address(1); }
+
+  // The address leased to `host`, allocating one if it has none. `index`
+  // is set to the address's offset in the subnet.
+  std::string acquire(const std::string &host, size_t *index = nullptr);
+  // Returns false if `host` had no lease
+  bool release(const std::string &host);
+
+private:
+  Subnet subnet_;
+  LeaseTable table_;
+};
+
+struct SubnetLease {
+  Subnet subnet;
+  // Unique among the subnets of all pools
+  size_t index;
+};
+
+// Lease a subnet for the network `name` from the pools in CAPPRUN_NET_POOLS,
+// whose tables are kept under `dir`. Subnets containing one of
+// `host_addrs` aren't handed out.
+SubnetLease subnet_acquire(const boost::filesystem::path &dir,
+                           const std::string &name,
+                           const std::vector<std::string> &host_addrs);
+
+// Release the subnet leased to `name`. Returns false if it had none.
+bool subnet_release(const boost::filesystem::path &dir,
+                    const std::string &name);
@@ -0,0 +1,115 @@
+#include "layers.h"
+#include "tar.h"
+
+#include <boost/algorithm/string.hpp>
+#include <fcntl.h>
+#include <string.h>
+#include <sstream>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+static std::string digest_hex(const std::string &digest) {
+  if (digest.rfind("sha256:", 0) != 0 ||
+      digest.find('/') != std::string::npos) {
+    throw std::runtime_error("Unsupported digest: " + digest);
+  }
+  return digest.substr(7);
+}
+
+LayerStore::LayerStore(const boost::filesystem::path &root) : root_(root) {
+  boost::filesystem::create_directories(root_ / "sha256");
+  auto lock = root_ / ".lock";
+  lock_fd_ = open(lock.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to open " + lock.string());
+  }
+  // Users share the store, prune() needs it to itself
+  if (flock(lock_fd_, LOCK_SH) != 0) {
+    close(lock_fd_);
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to lock " + lock.string());
+  }
+}
+
+LayerStore::~LayerStore() { close(lock_fd_); }
+
+boost::filesystem::path LayerStore::path(const std::string &digest) const {
+  return root_ / "sha256" / digest_hex(digest);
+}
+
+bool LayerStore::has(const std::string &digest) const {
+  return boost::filesystem::is_directory(path(digest));
+}
+
+boost::filesystem::path
+LayerStore::blob_path(const std::string &digest) const {
+  std::stringstream ss;
+  ss << std::this_thread::get_id();
+  return root_ / "sha256" /
+         (digest_hex(digest) + ".blob-" + std::to_string(getpid()) + "-" +
+          ss.str());
+}
+
+void LayerStore::add(const std::string &digest,
+                     const boost::filesystem::path &blob) {
+  auto dst = path(digest);
+  auto tmp = boost::filesystem::path(blob.string() + ".d");
+  boost::filesystem::remove_all(tmp);
+  boost::filesystem::create_directories(tmp);
+
+  try {
+    tar_extract(blob, tmp, std::thread::hardware_concurrency());
+  } catch (const std::exception &ex) {
+    boost::filesystem::remove_all(tmp);
+    throw std::runtime_error("Unable to extract layer " + digest + ": " +
+                             ex.what());
+  }
+
+  // Someone else may have unpacked the same layer in the meantime
+  if (rename(tmp.c_str(), dst.c_str()) != 0) {
+    int err = errno;
+    boost::filesystem::remove_all(tmp);
+    if (!has(digest)) {
+      throw std::system_error(err, std::generic_category(),
+                              "Unable to add layer " + digest);
+    }
+  }
+}
+
+size_t LayerStore::prune(
+    const std::function<std::set<std::string>()> &referenced) {
+  // Upgrade to an exclusive lock only if no one else is using the store.
+  // flock() drops the shared lock first, so what's referenced can only be
+  // known once this succeeds.
+  if (flock(lock_fd_, LOCK_EX | LOCK_NB) != 0) {
+    flock(lock_fd_, LOCK_SH);
+    return 0;
+  }
+  auto keep = referenced();
+  size_t removed = 0;
+  for (auto &entry : boost::filesystem::directory_iterator(root_ / "sha256")) {
+    // Indexes cached beside a layer (see UserDb) go with it
+    auto name = entry.path().filename().string();
+    // Only the layers themselves count, not their indexes or leftovers of an
+    // interrupted pull
+    bool layer = name.find('.') == std::string::npos &&
+                 boost::filesystem::is_directory(entry.path());
+    for (const auto &suffix : {".passwd", ".group"}) {
+      if (boost::algorithm::ends_with(name, suffix)) {
+        name.resize(name.size() - strlen(suffix));
+      }
+    }
+    auto digest = "sha256:" + name;
+    if (keep.count(digest) == 0) {
+      boost::filesystem::remove_all(entry.path());
+      if (layer) {
+        removed++;
+      }
+    }
+  }
+  flock(lock_fd_, LOCK_SH);
+  return removed;
+}
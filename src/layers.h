@@ -0,0 +1,36 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <functional>
+#include <set>
+#include <string>
+
+// Image layers unpacked once per digest and shared by every service (and app)
+// that uses them. Whiteouts are stored in overlayfs format so a service's
+// rootfs is an overlay with its image's layers as lowerdirs.
+class LayerStore {
+public:
+  LayerStore(const boost::filesystem::path &root);
+  ~LayerStore();
+  LayerStore(const LayerStore &) = delete;
+  LayerStore &operator=(const LayerStore &) = delete;
+
+  boost::filesystem::path path(const std::string &digest) const;
+  bool has(const std::string &digest) const;
+
+  // Where to download a blob before unpacking it
+  boost::filesystem::path blob_path(const std::string &digest) const;
+
+  // Unpack a layer tarball into the store
+  void add(const std::string &digest, const boost::filesystem::path &blob);
+
+  // Remove layers not returned by `referenced`, which is only called once
+  // the store is locked exclusively so a pull finishing in the meantime
+  // can't be missed. This is skipped if another process is using the store.
+  // Returns the number of layers removed.
+  size_t prune(const std::function<std::set<std::string>()> &referenced);
+
+private:
+  boost::filesystem::path root_;
+  int lock_fd_;
+};
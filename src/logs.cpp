@@ -0,0 +1,307 @@
+#include "logs.h"
+
+#include <ctype.h>
+#include <endian.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "json.h"
+
+// Longer lines are split so a single record stays a sane size
+static const size_t max_line = 16384;
+
+static std::string env(const char *name, const char *def) {
+  const char *val = getenv(name);
+  return val == nullptr ? def : val;
+}
+
+static std::runtime_error invalid(const char *name, const std::string &val) {
+  return std::runtime_error("Invalid " + std::string(name) + ": " + val);
+}
+
+// The std::sto* functions accept leading space, a sign and trailing garbage,
+// so the whole value is checked to be a plain non-negative number.
+static double env_double(const char *name, const char *def) {
+  auto val = env(name, def);
+  if (val.empty() || !(isdigit(val[0]) || val[0] == '.')) {
+    throw invalid(name, val);
+  }
+  size_t pos = 0;
+  double num;
+  try {
+    num = std::stod(val, &pos);
+  } catch (const std::exception &ex) {
+    throw invalid(name, val);
+  }
+  if (pos != val.size()) {
+    throw invalid(name, val);
+  }
+  return num;
+}
+
+static size_t env_size(const char *name, const char *def) {
+  auto val = env(name, def);
+  if (val.empty() || !isdigit(val[0])) {
+    throw invalid(name, val);
+  }
+  size_t pos = 0;
+  size_t num;
+  try {
+    num = std::stoull(val, &pos);
+  } catch (const std::exception &ex) {
+    throw invalid(name, val);
+  }
+  if (pos != val.size()) {
+    throw invalid(name, val);
+  }
+  return num;
+}
+
+LogOptions LogOptions::Load(LogFormat default_format) {
+  LogOptions opts;
+  auto format = env("CAPPRUN_LOG_FORMAT", "");
+  if (format.empty()) {
+    opts.format = default_format;
+  } else if (format == "raw") {
+    opts.format = LogFormat::Raw;
+  } else if (format == "text") {
+    opts.format = LogFormat::Text;
+  } else if (format == "json") {
+    opts.format = LogFormat::Json;
+  } else if (format == "journal") {
+    opts.format = LogFormat::Journal;
+  } else {
+    throw std::runtime_error("Invalid CAPPRUN_LOG_FORMAT: " + format);
+  }
+  opts.rate = env_double("CAPPRUN_LOG_RATE", "0");
+  opts.burst = env_size("CAPPRUN_LOG_BURST", "1000");
+  opts.buffer = env_size("CAPPRUN_LOG_BUFFER", "1048576");
+  return opts;
+}
+
+LogStream::LogStream(LogPipeline &pipeline, const std::string &service,
+                     const std::string &prefix)
+    : pipeline_(pipeline), service_(service), prefix_(prefix),
+      tokens_(pipeline.opts_.burst),
+      refilled_(std::chrono::steady_clock::now()), suppressed_(0) {}
+
+void LogStream::write(const char *buf, size_t len) {
+  while (len > 0) {
+    auto nl = (const char *)memchr(buf, '\n', len);
+    size_t n = nl == nullptr ? len : nl - buf;
+    partial_.append(buf, n);
+    if (nl != nullptr) {
+      line(std::move(partial_));
+      partial_.clear();
+      n++;
+    } else if (partial_.size() >= max_line) {
+      line(std::move(partial_));
+      partial_.clear();
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+void LogStream::flush() {
+  if (!partial_.empty()) {
+    line(std::move(partial_));
+    partial_.clear();
+  }
+  if (suppressed_ > 0) {
+    notice("Suppressed " + std::to_string(suppressed_) +
+           " lines exceeding the rate limit");
+    suppressed_ = 0;
+  }
+}
+
+void LogStream::notice(const std::string &msg) {
+  LogPipeline::record rec{service_, prefix_, msg, {}, LOG_NOTICE};
+  clock_gettime(CLOCK_REALTIME, &rec.time);
+  pipeline_.push(std::move(rec));
+}
+
+// A token bucket refilled at `rate` lines per second
+bool LogStream::allow() {
+  double rate = pipeline_.opts_.rate;
+  if (rate <= 0) {
+    return true;
+  }
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - refilled_;
+  refilled_ = now;
+  tokens_ = std::min<double>(pipeline_.opts_.burst,
+                             tokens_ + elapsed.count() * rate);
+  if (tokens_ < 1) {
+    return false;
+  }
+  tokens_ -= 1;
+  return true;
+}
+
+void LogStream::line(std::string text) {
+  if (!allow()) {
+    suppressed_++;
+    return;
+  }
+  if (suppressed_ > 0) {
+    notice("Suppressed " + std::to_string(suppressed_) +
+           " lines exceeding the rate limit");
+    suppressed_ = 0;
+  }
+  if (!text.empty() && text.back() == '\r') {
+    text.pop_back();
+  }
+  LogPipeline::record rec{service_, prefix_, std::move(text), {}, LOG_INFO};
+  clock_gettime(CLOCK_REALTIME, &rec.time);
+  pipeline_.push(std::move(rec));
+}
+
+LogPipeline::LogPipeline(const LogOptions &opts, const std::string &app,
+                         int fd)
+    : opts_(opts), app_(app), fd_(fd), journal_(-1), queued_(0),
+      stop_(false) {
+  if (opts_.format == LogFormat::Journal) {
+    journal_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, "/run/systemd/journal/socket");
+    if (journal_ < 0 ||
+        connect(journal_, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      int err = errno;
+      if (journal_ >= 0) {
+        close(journal_);
+      }
+      throw std::system_error(err, std::generic_category(),
+                              "Unable to connect to the journal");
+    }
+  }
+  writer_ = std::thread(&LogPipeline::run, this);
+}
+
+LogPipeline::~LogPipeline() {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    stop_ = true;
+  }
+  ready_.notify_one();
+  writer_.join();
+  if (journal_ >= 0) {
+    close(journal_);
+  }
+}
+
+std::unique_ptr<LogStream> LogPipeline::stream(const std::string &service,
+                                               const std::string &prefix) {
+  return std::unique_ptr<LogStream>(new LogStream(*this, service, prefix));
+}
+
+void LogPipeline::push(record &&rec) {
+  size_t size = rec.prefix.size() + rec.text.size() + 1;
+  std::lock_guard<std::mutex> guard(lock_);
+  if (queued_ + size > opts_.buffer && !queue_.empty()) {
+    dropped_[rec.service]++;
+    return;
+  }
+  queued_ += size;
+  queue_.push_back(std::move(rec));
+  ready_.notify_one();
+}
+
+void LogPipeline::render(const record &rec, std::string &out) const {
+  if (opts_.format == LogFormat::Json) {
+    char buf[64];
+    struct tm tm;
+    gmtime_r(&rec.time.tv_sec, &tm);
+    size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, sizeof(buf) - n, ".%06ldZ", rec.time.tv_nsec / 1000);
+    nlohmann::json line = {
+        {"time", buf}, {"service", rec.service}, {"message", rec.text}};
+    if (rec.priority != LOG_INFO) {
+      line["capp-run"] = true;
+    }
+    // Container output isn't always valid UTF-8
+    out += line.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+  } else {
+    out += rec.prefix;
+    out += rec.text;
+  }
+  out += "\n";
+}
+
+void LogPipeline::send_journal(const record &rec) const {
+  std::string msg;
+  msg += "PRIORITY=" + std::to_string(rec.priority) + "\n";
+  msg += "SYSLOG_IDENTIFIER=" + app_ + "-" + rec.service + "\n";
+  msg += "CAPPRUN_APP=" + app_ + "\n";
+  msg += "CAPPRUN_SERVICE=" + rec.service + "\n";
+  // The binary form copes with any content
+  msg += "MESSAGE\n";
+  uint64_t len = htole64(rec.text.size());
+  msg.append((const char *)&len, sizeof(len));
+  msg += rec.text;
+  msg += "\n";
+  while (send(journal_, msg.data(), msg.size(), MSG_NOSIGNAL) < 0 &&
+         errno == EINTR) {
+  }
+}
+
+void LogPipeline::run() {
+  while (true) {
+    std::deque<record> batch;
+    std::map<std::string, size_t> dropped;
+    {
+      std::unique_lock<std::mutex> guard(lock_);
+      ready_.wait(guard, [&] { return stop_ || !queue_.empty(); });
+      if (queue_.empty() && dropped_.empty()) {
+        return;
+      }
+      batch.swap(queue_);
+      dropped.swap(dropped_);
+      queued_ = 0;
+    }
+
+    for (const auto &it : dropped) {
+      std::string prefix;
+      for (const auto &rec : batch) {
+        if (rec.service == it.first) {
+          prefix = rec.prefix;
+          break;
+        }
+      }
+      record rec{it.first, prefix,
+                 "Dropped " + std::to_string(it.second) +
+                     " lines, the log sink is too slow",
+                 {}, LOG_WARNING};
+      clock_gettime(CLOCK_REALTIME, &rec.time);
+      batch.push_back(std::move(rec));
+    }
+
+    if (opts_.format == LogFormat::Journal) {
+      for (const auto &rec : batch) {
+        send_journal(rec);
+      }
+      continue;
+    }
+    std::string out;
+    for (const auto &rec : batch) {
+      render(rec, out);
+    }
+    const char *buf = out.data();
+    size_t len = out.size();
+    while (len > 0) {
+      ssize_t n = ::write(fd_, buf, len);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n < 0) {
+        break; // nowhere left to report it
+      }
+      buf += n;
+      len -= n;
+    }
+  }
+}
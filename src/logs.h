@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum class LogFormat {
+  Raw,     // copied as-is
+  Text,    // "<prefix><line>"
+  Json,    // {"time", "service", "message"} per line
+  Journal, // journald's native protocol
+};
+
+struct LogOptions {
+  LogFormat format;
+  double rate;   // lines per second allowed from a service, 0 for no limit
+  size_t burst;  // lines allowed in a burst above the rate
+  size_t buffer; // bytes held for a slow sink before lines are dropped
+
+  // Read from CAPPRUN_LOG_FORMAT (raw, text, json or journal),
+  // CAPPRUN_LOG_RATE, CAPPRUN_LOG_BURST and CAPPRUN_LOG_BUFFER.
+  static LogOptions Load(LogFormat default_format);
+};
+
+class LogPipeline;
+
+// The output of one service. Not thread safe, each producer needs its own.
+class LogStream {
+public:
+  void write(const char *buf, size_t len);
+  // Emit what's left of a line that was never terminated
+  void flush();
+  // A message from capp-run itself about the service
+  void notice(const std::string &msg);
+
+private:
+  friend class LogPipeline;
+  LogStream(LogPipeline &pipeline, const std::string &service,
+            const std::string &prefix);
+
+  void line(std::string text);
+  bool allow();
+
+  LogPipeline &pipeline_;
+  std::string service_;
+  std::string prefix_;
+  std::string partial_;
+  double tokens_;
+  std::chrono::steady_clock::time_point refilled_;
+  size_t suppressed_;
+};
+
+// Frames service output into lines and writes them to `fd`, or the journal,
+// from a background thread. Producers never block on the sink: when it can't
+// keep up, lines are dropped and the number dropped is reported once it
+// catches up.
+class LogPipeline {
+public:
+  LogPipeline(const LogOptions &opts, const std::string &app, int fd);
+  ~LogPipeline();
+  LogPipeline(const LogPipeline &) = delete;
+  LogPipeline &operator=(const LogPipeline &) = delete;
+
+  std::unique_ptr<LogStream> stream(const std::string &service,
+                                    const std::string &prefix);
+
+private:
+  friend class LogStream;
+
+  struct record {
+    std::string service;
+    std::string prefix;
+    std::string text;
+    struct timespec time;
+    int priority;
+  };
+
+  void push(record &&rec);
+  void run();
+  void render(const record &rec, std::string &out) const;
+  void send_journal(const record &rec) const;
+
+  LogOptions opts_;
+  std::string app_;
+  int fd_;
+  int journal_;
+
+  std::mutex lock_;
+  std::condition_variable ready_;
+  std::deque<record> queue_;
+  size_t queued_;
+  std::map<std::string, size_t> dropped_;
+  bool stop_;
+  std::thread writer_;
+};
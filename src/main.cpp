@@ -5,18 +5,30 @@
 
 namespace bp = ::boost::process;
 
+#include <algorithm>
 #include <boost/filesystem.hpp>
+#include <fcntl.h>
 #include <iostream>
-#include <poll.h>
+#include <set>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 
 #include "CLI11.hpp"
 
 #include "capp.h"
 #include "context.h"
+#include "daemon.h"
+#include "logs.h"
+#include "net.h"
 #include "oci-hooks.h"
+#include "scheduler.h"
 
-static void runall(const std::string &app_name);
+static void runall(const std::string &app_name, size_t jobs);
 
 int main(int argc, char **argv) {
   CLI::App app{"capp-run"};
@@ -33,14 +45,25 @@ int main(int argc, char **argv) {
   up.add_option("service", svc, "Compose service")->required();
   auto &pull = *app.add_subcommand("pull", "Pull container image(s)");
   pull.add_option("service", svc, "Compose service");
+  size_t pull_jobs = 4;
+  pull.add_option("-j,--jobs", pull_jobs, "Maximum concurrent downloads",
+                  true);
   auto &create = *app.add_subcommand("createRuntime", "OCI createRuntime hook");
   create.add_option("service", svc, "Compose service")->required();
   auto &teardown = *app.add_subcommand("poststop", "OCI poststop hook");
   teardown.add_option("service", svc, "Compose service")->required();
   auto &upall = *app.add_subcommand("upall", "Start all services");
+  size_t jobs = std::max(1U, std::thread::hardware_concurrency());
+  upall.add_option("-j,--jobs", jobs,
+                   "Maximum number of services starting at once", true);
   auto &status = *app.add_subcommand("status", "Get status of services");
+  bool status_json = false;
+  status.add_flag("--json", status_json,
+                  "Print state and resource usage of services as JSON");
   auto &systemd =
       *app.add_subcommand("sync-systemd", "Ensure systemd units are in place");
+  auto &daemon = *app.add_subcommand(
+      "daemon", "Keep the project loaded and serve requests for it");
 
   app.require_subcommand(1);
   CLI11_PARSE(app, argc, argv);
@@ -54,17 +77,19 @@ int main(int argc, char **argv) {
     if (up) {
       capp_up(app_name, svc);
     } else if (pull) {
-      capp_pull(app_name, svc);
+      capp_pull(app_name, svc, pull_jobs);
     } else if (create) {
       oci_createRuntime(app_name, svc);
     } else if (teardown) {
       oci_poststop(app_name, svc);
     } else if (upall) {
-      runall(app_name);
+      runall(app_name, jobs);
     } else if (status) {
-      capp_status(app_name);
+      capp_status(app_name, status_json);
     } else if (systemd) {
       capp_sync_systemd("/etc/systemd/system", app_name);
+    } else if (daemon) {
+      capp_daemon(app_name);
     }
   } catch (const std::exception &ex) {
     std::cerr << ex.what() << "\n";
@@ -74,62 +99,238 @@ int main(int argc, char **argv) {
   return 0;
 }
 
-static void run(const std::string &capp_exe, const std::string &app_name,
-                const std::string &svc_name, size_t prefix_width) {
-  std::string prefix = svc_name;
-  auto pad = prefix_width - svc_name.size();
-  while (pad--) {
-    prefix += " ";
-  }
-  prefix += " | ";
+// A `capp-run up` started by upall
+struct child {
+  pid_t pid;
+  int out;   // its stdout and stderr, -1 once closed
+  int pidfd; // -1 when its exit is noticed through SIGCHLD instead
+  bool exited;
+  bool reported;
+  int status;
+  std::unique_ptr<LogStream> stream;
+};
 
-  std::string cmd = capp_exe + " -n " + app_name + " up " + svc_name;
-  FILE *fp = popen(cmd.c_str(), "r");
-  if (fp == NULL) {
-    perror("Unable to start service");
-    exit(1);
+static std::unique_ptr<child> spawn(const std::string &capp_exe,
+                                    const std::string &app_name,
+                                    const std::string &svc_name,
+                                    std::unique_ptr<LogStream> stream) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to create pipe");
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to start " + svc_name);
+  } else if (pid == 0) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, nullptr);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    execl(capp_exe.c_str(), capp_exe.c_str(), "-n", app_name.c_str(), "up",
+          svc_name.c_str(), NULL);
+    _exit(127);
   }
-  char buf[1024];
-  while (fgets(buf, sizeof(buf), fp) != NULL) {
-    std::cout << prefix << buf;
+  close(pipefd[1]);
+
+  std::unique_ptr<child> c(new child{pid, pipefd[0], -1, false, false, 0,
+                                     std::move(stream)});
+#ifdef SYS_pidfd_open
+  c->pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+  return c;
+}
+
+// Print how a child ended once its output is drained, returns true if it did
+static bool report(child &c) {
+  if (c.reported || !c.exited || c.out >= 0) {
+    return false;
   }
-  int status = pclose(fp);
-  if (status == -1) {
-    perror("Unable to close service");
+  c.reported = true;
+  int status = c.status;
+  if (WIFEXITED(status)) {
+    c.stream->notice("exited with rc=" + std::to_string(WEXITSTATUS(status)));
+  } else if (WIFSIGNALED(status)) {
+    c.stream->notice("killed with sig=" + std::to_string(WTERMSIG(status)));
   } else {
-    std::cout << prefix;
-    if (WIFEXITED(status)) {
-      std::cout << "exited with rc=" << WEXITSTATUS(status) << "\n";
-    } else if (WIFSIGNALED(status)) {
-      std::cout << "killed with sig=" << WTERMSIG(status) << "\n";
-    } else if (WIFSTOPPED(status)) {
-      std::cout << "stopped with sig=" << WSTOPSIG(status) << "\n";
-    } else {
-      std::cout << "unexpectedly ended with " << status << "\n";
-    }
+    c.stream->notice("unexpectedly ended with " + std::to_string(status));
   }
+  return true;
 }
 
-static void runall(const std::string &app_name) {
+static void epoll_add(int epfd, int fd) {
+  struct epoll_event ev {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to watch file descriptor");
+  }
+}
+
+static void epoll_close(int epfd, int &fd) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  fd = -1;
+}
+
+// Services are started as child processes whose output pipes, pidfds and a
+// signalfd for SIGCHLD (when pidfds aren't available) are all handled by a
+// single epoll loop.
+static void runall(const std::string &app_name, size_t jobs) {
   auto ctx = Context::Load(app_name);
   auto proj = ProjectDefinition::Load("docker-compose.json");
-  auto exe = boost::filesystem::read_symlink("/proc/self/exe");
+  auto exe = boost::filesystem::read_symlink("/proc/self/exe").string();
 
   size_t width = 0;
-  for (const auto svc : proj.services) {
+  std::set<std::string> networks;
+  for (const auto &svc : proj.services) {
     if (svc.name.size() > width) {
       width = svc.name.size();
     }
+    networks.insert(svc.networks.begin(), svc.networks.end());
+  }
+
+  // Create the networks up front rather than having services that share
+  // one race to create it from their createRuntime hooks.
+  for (const auto &net : networks) {
+    network_render(ctx, net);
+  }
+
+  auto opts = LogOptions::Load(LogFormat::Text);
+  if (opts.format == LogFormat::Raw) {
+    opts.format = LogFormat::Text; // services are told apart by prefix
   }
+  // Output is framed here, the services just pass theirs through
+  unsetenv("CAPPRUN_LOG_FORMAT");
+  unsetenv("CAPPRUN_LOG_RATE");
 
-  std::vector<std::thread> threads;
-  for (const auto svc : proj.services) {
-    std::string cmd = exe.string() + " -n " + app_name + " up " + svc.name;
-    std::thread t(run, exe.string(), app_name, svc.name, width);
-    threads.push_back(std::move(t));
+  // Blocked before the log writer thread is started so it inherits the mask,
+  // otherwise SIGCHLD could be delivered to it rather than the signalfd.
+  sigset_t mask, orig;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &orig);
+  LogPipeline logs(opts, app_name, STDOUT_FILENO);
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (epfd < 0 || sigfd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to set up event loop");
   }
+  epoll_add(epfd, sigfd);
 
-  for (auto &t : threads) {
-    t.join();
+  StartScheduler sched(proj, jobs);
+  std::map<std::string, std::unique_ptr<child>> children;
+  std::map<int, child *> by_fd;
+  size_t live = 0;
+  char buf[65536];
+  while (!sched.done() || live > 0) {
+    for (const auto &svc : sched.next()) {
+      std::string prefix = svc + std::string(width - svc.size(), ' ') + " | ";
+      auto c = spawn(exe, app_name, svc, logs.stream(svc, prefix));
+      epoll_add(epfd, c->out);
+      by_fd[c->out] = c.get();
+      if (c->pidfd >= 0) {
+        epoll_add(epfd, c->pidfd);
+        by_fd[c->pidfd] = c.get();
+      }
+      children[svc] = std::move(c);
+      live++;
+    }
+
+    struct epoll_event events[32];
+    int n = epoll_wait(epfd, events, 32, 100);
+    if (n < 0 && errno != EINTR) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to wait for services");
+    }
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == sigfd) {
+        struct signalfd_siginfo info;
+        while (read(sigfd, &info, sizeof(info)) > 0) {
+        }
+        continue;
+      }
+
+      auto it = by_fd.find(fd);
+      if (it == by_fd.end()) {
+        continue;
+      }
+      auto &c = *it->second;
+      if (fd == c.out) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+          continue;
+        } else if (len > 0) {
+          c.stream->write(buf, len);
+          continue;
+        }
+        c.stream->flush();
+        by_fd.erase(it);
+        epoll_close(epfd, c.out);
+      } else if (waitpid(c.pid, &c.status, WNOHANG) == c.pid) {
+        c.exited = true;
+        by_fd.erase(it);
+        epoll_close(epfd, c.pidfd);
+      }
+      if (report(c)) {
+        live--;
+      }
+    }
+
+    // Children without a pidfd are checked on every pass rather than only
+    // on SIGCHLD, which coalesces and so may not come for each of them.
+    for (auto &it : children) {
+      auto &c = *it.second;
+      if (c.pidfd < 0 && !c.exited &&
+          waitpid(c.pid, &c.status, WNOHANG) == c.pid) {
+        c.exited = true;
+        if (report(c)) {
+          live--;
+        }
+      }
+    }
+
+    auto starting = sched.starting();
+    for (const auto &svc : starting) {
+      if (capp_running(ctx, svc)) {
+        sched.running(svc);
+        continue;
+      }
+      auto &c = *children[svc];
+      if (!c.exited) {
+        continue;
+      }
+      if (WIFEXITED(c.status) && WEXITSTATUS(c.status) == 0) {
+        // A one-shot service that completed before we saw it running
+        sched.running(svc);
+      } else {
+        for (const auto &skipped : sched.failed(svc)) {
+          c.stream->notice("failed to start, not starting " + skipped);
+        }
+      }
+    }
   }
-}
\ No newline at end of file
+
+  close(sigfd);
+  close(epfd);
+  sigprocmask(SIG_SETMASK, &orig, nullptr);
+
+  // Networks are left alone if a service started outside of upall uses them
+  for (const auto &net : networks) {
+    bool used = false;
+    for (const auto &svc : proj.services) {
+      if (std::count(svc.networks.begin(), svc.networks.end(), net) > 0 &&
+          capp_running(ctx, svc.name)) {
+        used = true;
+      }
+    }
+    if (!used) {
+      network_remove(ctx, net);
+    }
+  }
+}
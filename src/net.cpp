@@ -6,6 +6,10 @@
 
 #include "json.h"
 
+#include "firewall.h"
+#include "hosts.h"
+#include "ipam.h"
+#include "netlink.h"
 #include "utils.h"
 
 static int shell(const std::string &command, std::string *output) {
@@ -27,108 +31,64 @@ static int shell(const std::string &command, std::string *output) {
   return WEXITSTATUS(exitcode);
 }
 
-class LockedFile {
-public:
-  LockedFile(const boost::filesystem::path &path);
-  ~LockedFile();
+// The mk-network/rm-network scripts are always written so they can be used
+// for debugging, but are only executed when CAPPRUN_NET_SCRIPTS is set.
+// Otherwise links are configured in-process over rtnetlink.
+static bool use_scripts() { return getenv("CAPPRUN_NET_SCRIPTS") != nullptr; }
 
-  std::string read() const;
-  void write(const std::string &buf);
-
-private:
-  FILE *fd_;
-};
-
-LockedFile::LockedFile(const boost::filesystem::path &path) {
-  fd_ = fopen(path.string().c_str(), "a+");
-  if (fd_ == NULL) {
-    throw std::system_error(errno, std::generic_category(),
-                            "Unable to open " + path.string());
-  }
-  if (flock(fileno(fd_), LOCK_EX) != 0) {
-    throw std::system_error(errno, std::generic_category(),
-                            "Unable to lock " + path.string());
-  }
-}
-
-LockedFile::~LockedFile() { fclose(fd_); }
-
-std::string LockedFile::read() const {
-  fseek(fd_, 0, SEEK_END);
-  size_t size = ftell(fd_);
-  fseek(fd_, 0, SEEK_SET);
-
-  char *buf = (char *)calloc(size + 1, 1);
-  if (fread(buf, 1, size, fd_) != size) {
-    free(buf);
-    throw std::system_error(errno, std::generic_category(),
-                            "Unable to read contents file");
-  }
-  std::string rv(buf);
-  free(buf);
-  return rv;
+// Interface names are derived from the network's subnet index, and the
+// container's address within it, so they're unique without looking at what's
+// on the host. They fit in IFNAMSIZ with the "br-" prefix of the veth peer.
+static std::string bridge_name(size_t index) {
+  return "bcomp-" + std::to_string(index);
 }
 
-void LockedFile::write(const std::string &buf) {
-  fseek(fd_, 0, SEEK_SET);
-  ftruncate(fileno(fd_), 0);
-  fwrite(buf.c_str(), 1, buf.size(), fd_);
+static std::string veth_name(size_t index, size_t host) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "vc%zx-%zx", index, host);
+  return buf;
 }
 
-static std::string
-find_bridge(const std::map<std::string, std::string> &interfaces) {
-  std::string base = "bcomp-";
-  for (int i = 1; i < 30; i++) {
-    std::string name = base + std::to_string(i);
-    if (interfaces.find(name) == interfaces.end()) {
-      return name;
-    }
-  }
-  throw std::runtime_error("Unable to find an available bridge");
+// The network's info is written last, and with a rename, so that once it
+// exists the network is completely set up.
+static void write_info(const boost::filesystem::path &path,
+                       const nlohmann::json &data) {
+  auto tmp = path / "info.tmp";
+  open_write(tmp) << data;
+  boost::filesystem::rename(tmp, path / "info");
 }
 
-static bool contains_val(const std::map<std::string, std::string> &interfaces,
-                         const std::string &val) {
-  for (const auto &it : interfaces) {
-    if (it.second == val) {
-      return true;
-    }
-  }
-  return false;
-}
+void network_render(const Context &ctx, const std::string &name) {
+  auto path = ctx.var_run / "networks" / name;
+  auto gwinfo = path / "info";
 
-static std::string
-find_netbase(const std::map<std::string, std::string> &interfaces) {
-  std::string base = "172.42.";
-  for (int i = 1; i < 30; i++) {
-    std::string name = base + std::to_string(i);
-    if (!contains_val(interfaces, name + ".1")) {
-      return name;
-    }
+  // Every service on the network renders it when it starts, so skip the lock
+  // once it's in place.
+  if (boost::filesystem::exists(gwinfo)) {
+    ctx.out() << "Network(" << name << ") already in place\n";
+    return;
   }
-  throw std::runtime_error("Unable to find an available subnet");
-}
 
-void network_render(const Context &ctx, const std::string &name) {
-  auto path = ctx.var_run / "networks" / name;
   boost::filesystem::create_directories(path);
 
   // Make sure 2 different containers don't do this at the same time if they
   // share the same network
   LockedFile lock(path / ".lock");
 
-  auto gwinfo = path / "info";
   if (boost::filesystem::exists(gwinfo)) {
     ctx.out() << "Network(" << name << ") already in place\n";
     return;
   }
 
-  auto intf = ctx.network_interfaces();
-  auto bridge = find_bridge(intf);
+  auto lease = subnet_acquire(ctx.var_run.parent_path() / "subnets",
+                              ctx.app + "/" + name, ctx.links().addresses());
+  auto bridge = bridge_name(lease.index);
   ctx.out() << "Creating bridge: " << bridge << "\n";
-  auto base = find_netbase(intf);
-  std::string network = base + ".0";
-  std::string gateway = base + ".1";
+  auto network = lease.subnet.address(0);
+  auto subnet = lease.subnet.str();
+  Ipam ipam(path / "leases", subnet);
+  auto gateway = ipam.gateway();
+  auto prefixlen = std::to_string(ipam.prefixlen());
 
   ctx.out() << "Creating network(" << network << ") gateway-ip(" << gateway
             << ")\n";
@@ -136,25 +96,26 @@ void network_render(const Context &ctx, const std::string &name) {
   nlohmann::json data;
   data["gateway"] = gateway;
   data["bridge"] = bridge;
-  data["hosts"] = {};
-  open_write(gwinfo) << data;
+  data["subnet"] = subnet;
+  data["index"] = lease.index;
 
   auto mk = open_write(path / "mk-network");
   // TODO - the bridges are allowing traffic between them
   mk << "#!/bin/sh -ex\n"
      << "ip link add " << bridge << " type bridge\n"
      << "ip link set " << bridge << " up\n"
-     << "ip addr add " << gateway << "/24 brd + dev " << bridge << "\n"
+     << "ip addr add " << gateway << "/" << prefixlen << " brd + dev "
+     << bridge << "\n"
      << "iptables -A FORWARD -o " << bridge << " -j ACCEPT\n"
      << "iptables -A FORWARD -i " << bridge << " -j ACCEPT\n"
-     << "iptables -t nat -A POSTROUTING -s " << network
-     << "/24 -j MASQUERADE\n";
+     << "iptables -t nat -A POSTROUTING -s " << subnet
+     << " -j MASQUERADE\n";
   mk.close();
   chmod((path / "mk-network").string().c_str(), S_IRWXU);
 
   auto rm = open_write(path / "rm-network");
   rm << "#!/bin/sh -x\n"
-     << "iptables -t nat -D POSTROUTING -s " << network << "\n"
+     << "iptables -t nat -D POSTROUTING -s " << subnet << " -j MASQUERADE\n"
      << "iptables -D FORWARD -i " << bridge << " -j ACCEPT\n"
      << "iptables -D FORWARD -o " << bridge << " -j ACCEPT\n"
      << "ip link del name " << bridge << " type bridge\n"
@@ -162,117 +123,165 @@ void network_render(const Context &ctx, const std::string &name) {
   rm.close();
   chmod((path / "rm-network").string().c_str(), S_IRWXU);
 
-  std::string out;
-  int exit_code = shell((path / "mk-network").string(), &out);
-  ctx.out() << out << "\n";
-  if (exit_code != 0) {
-    throw std::runtime_error("Unable to setup network");
+  if (use_scripts()) {
+    std::string out;
+    int exit_code = shell((path / "mk-network").string(), &out);
+    ctx.out() << out << "\n";
+    if (exit_code != 0) {
+      throw std::runtime_error("Unable to setup network");
+    }
+    write_info(path, data);
+    return;
   }
+
+  // RTM_NEWADDR needs the bridge's index, so it has to exist first
+  Netlink nl;
+  nl.add_bridge(bridge, true);
+  nl.commit();
+  nl.add_addr(nl.link_index(bridge), gateway, ipam.prefixlen(), true);
+  nl.commit();
+
+  FirewallRules rules;
+  rules.add("filter", "FORWARD", "-o " + bridge + " -j ACCEPT");
+  rules.add("filter", "FORWARD", "-i " + bridge + " -j ACCEPT");
+  rules.add("nat", "POSTROUTING", "-s " + subnet + " -j MASQUERADE");
+  rules.save(path / "iptables.rules");
+  rules.apply();
+  write_info(path, data);
 }
 
 struct ipinfo {
   std::string ip;
+  int prefixlen;
   std::string gateway;
   std::string bridge;
+  std::string intf;
 };
 
-static ipinfo acquire_ip(const boost::filesystem::path &info,
+static nlohmann::json network_info(const boost::filesystem::path &netdir) {
+  nlohmann::json data;
+  open_read(netdir / "info") >> data;
+  // Networks used to be a fixed 172.42.x.0/24 whose addresses weren't leased.
+  // Their bridge is still in use, so it can't just be rendered again.
+  if (!data.contains("subnet") || !data.contains("index")) {
+    throw std::runtime_error("Network(" + netdir.filename().string() +
+                             ") was rendered by an older capp-run, restart "
+                             "the app");
+  }
+  return data;
+}
+
+static ipinfo acquire_ip(const boost::filesystem::path &netdir,
                          const std::string &host) {
+  auto data = network_info(netdir);
+  Ipam ipam(netdir / "leases", data["subnet"].get<std::string>());
   ipinfo inf{};
-  LockedFile lock(info);
-
-  nlohmann::json data;
-  open_read(info) >> data;
+  size_t slot;
+  inf.ip = ipam.acquire(host, &slot);
+  inf.prefixlen = ipam.prefixlen();
   inf.gateway = data["gateway"].get<std::string>();
   inf.bridge = data["bridge"].get<std::string>();
+  inf.intf = veth_name(data["index"].get<size_t>(), slot);
+  return inf;
+}
 
-  auto base = inf.gateway.substr(0, inf.gateway.size() - 1);
-  for (int i = 2; i < 30; i++) {
-    bool found = false;
-    std::string ip = base + std::to_string(i);
-    for (const auto &it : data["hosts"].items()) {
-      if (it.value() == ip) {
-        found = true;
-      } else if (it.key() == host) {
-        found = false;
-        ip = it.value();
-        break;
-      }
+// Returns false if any of the service's leases couldn't be released
+static bool release_ips(const Context &ctx, const Service &svc) {
+  bool ok = true;
+  for (const auto &net : svc.networks) {
+    auto netdir = ctx.var_run / "networks" / net;
+    if (!boost::filesystem::exists(netdir / "info")) {
+      continue;
     }
-    if (!found) {
-      data["hosts"][host] = ip;
-      inf.ip = ip;
-      open_write(info) << data;
-      return inf;
+    try {
+      auto data = network_info(netdir);
+      Ipam(netdir / "leases", data["subnet"].get<std::string>())
+          .release(svc.name);
+    } catch (const std::exception &ex) {
+      ctx.out() << "Unable to release address on " << net << ": " << ex.what()
+                << "\n";
+      ok = false;
     }
   }
-  throw std::runtime_error("Unable to find an available IP in network");
+  return ok;
 }
 
-static std::string
-find_intf(const std::map<std::string, std::string> &interfaces) {
-  std::string base = "vcomp-";
-  for (int i = 1; i < 30; i++) {
-    std::string name = base + std::to_string(i);
-    // the link we'll see is "br-" side - the "name" will be in a netns
-    if (interfaces.find("br-" + name) == interfaces.end()) {
-      return name;
+static void network_join_native(const std::vector<ipinfo> &joins, int pid) {
+  int nsfd = netns_open(pid);
+  try {
+    // Indexes are looked up before anything is queued so each namespace is
+    // configured with a single batch.
+    Netlink host;
+    std::map<std::string, int> bridges;
+    for (const auto &j : joins) {
+      if (bridges.count(j.bridge) == 0) {
+        bridges[j.bridge] = host.link_index(j.bridge);
+      }
     }
-  }
-  throw std::runtime_error("Unable to find an available interface");
-}
+    for (const auto &j : joins) {
+      host.add_veth("br-" + j.intf, bridges[j.bridge], j.intf, nsfd);
+    }
+    host.commit();
 
-static void _set_hosts(const boost::filesystem::path &path,
-                       const std::string &host, const std::string &ip) {
-  LockedFile hosts(path);
-  auto content = hosts.read();
-  if (content.size() == 0) {
-    content = "127.0.0.1\tlocalhost\n";
-  }
-  std::string line = ip + "\t" + host + "\n";
-  if (content.find(line) == std::string::npos) {
-    content += line;
+    Netlink container(nsfd);
+    std::vector<int> peers;
+    for (const auto &j : joins) {
+      peers.push_back(container.link_index(j.intf));
+    }
+    container.set_up("lo");
+    for (size_t i = 0; i < joins.size(); i++) {
+      container.add_addr(peers[i], joins[i].ip, joins[i].prefixlen, false);
+      container.set_up(joins[i].intf);
+    }
+    if (!joins.empty()) {
+      container.add_default_route(joins[0].gateway);
+    }
+    container.commit();
+  } catch (...) {
+    close(nsfd);
+    throw;
   }
-  hosts.write(content);
+  close(nsfd);
 }
 
 void network_join(const Context &ctx, const Service &svc, int pid) {
   std::string ns = ctx.app + "-" + svc.name;
 
-  LockedFile lock(ctx.var_run / ".lock");
+  // Addresses, interface names, the hosts file and firewall rules are safe to
+  // update concurrently, so only the service's own files need a lock.
   auto path = ctx.var_run / svc.name;
   boost::filesystem::create_directories(path);
+  LockedFile lock(path / ".lock");
 
   auto rm = open_write(path / "rm-network");
   rm << "#!/bin/sh -x\n";
 
   auto mk = open_write(path / "mk-network");
 
-  auto interfaces = ctx.network_interfaces();
-
   mk << "#!/bin/sh -ex\n"
      << "[ -d /var/run/netns ] || mkdir /var/run/netns\n"
      << "ln -sf /proc/" << pid << "/ns/net /var/run/netns/" << ns << "\n";
 
+  std::vector<ipinfo> joins;
+  std::vector<host_entry> hosts;
   std::string default_ip;
   bool default_set = false;
   for (const auto net : svc.networks) {
     ctx.out() << "Joining " << net << "\n";
-    auto inf = acquire_ip(ctx.var_run / "networks" / net / "info", svc.name);
+    auto inf = acquire_ip(ctx.var_run / "networks" / net, svc.name);
     ctx.out() << " bridge: " << inf.bridge << "\n";
     ctx.out() << " gateway: " << inf.gateway << "\n";
     ctx.out() << " ip: " << inf.ip << "\n";
 
-    auto intf = find_intf(interfaces);
+    auto intf = inf.intf;
     ctx.out() << " interface: " << intf << "\n";
-    interfaces["br-" + intf] =
-        inf.ip; // mark it so the next loop doesn't use it
+    joins.push_back(inf);
 
     mk << "\n# net " << net << "\n"
        << "ip link add " << intf << " type veth peer name br-" << intf << "\n"
        << "ip link set " << intf << " netns " << ns << "\n"
-       << "ip netns exec " << ns << " ip addr add " << inf.ip << "/24 dev "
-       << intf << "\n"
+       << "ip netns exec " << ns << " ip addr add " << inf.ip << "/"
+       << inf.prefixlen << " dev " << intf << "\n"
        << "ip link set br-" << intf << " up\n"
        << "ip netns exec " << ns << " ip link set lo up\n"
        << "ip netns exec " << ns << " ip link set " << intf << " up\n"
@@ -285,21 +294,29 @@ void network_join(const Context &ctx, const Service &svc, int pid) {
       default_set = true;
     }
 
-    _set_hosts(ctx.var_run / "etc_hosts", svc.name, inf.ip);
+    hosts.push_back({inf.ip, svc.name});
   }
 
-  for (const auto h : svc.extra_hosts) {
-    _set_hosts(ctx.var_run / "etc_hosts", h.first, h.second);
+  for (const auto &h : svc.extra_hosts) {
+    hosts.push_back({h.second, h.first});
+  }
+  {
+    HostsTable table(ctx.var_run / "etc_hosts");
+    table.set(svc.name, hosts);
+    table.save();
   }
 
+  FirewallRules rules;
   for (const auto &p : svc.ports) {
-    mk << "iptables -t nat -A OUTPUT -p " << p.protocol << " --match "
-       << p.protocol << " --dport " << p.host_port << " --jump DNAT --to "
-       << default_ip << ":" << p.target_port << "\n";
-    rm << "iptables -t nat -D OUTPUT -p " << p.protocol << " --match "
-       << p.protocol << " --dport " << p.host_port << " --jump DNAT --to "
-       << default_ip << ":" << p.target_port << "\n";
+    std::string rule = "-p " + p.protocol + " --match " + p.protocol +
+                       " --dport " + std::to_string(p.host_port) +
+                       " --jump DNAT --to " + default_ip + ":" +
+                       std::to_string(p.target_port);
+    mk << "iptables -t nat -A OUTPUT " << rule << "\n";
+    rm << "iptables -t nat -D OUTPUT " << rule << "\n";
+    rules.add("nat", "OUTPUT", rule);
   }
+  rules.save(path / "iptables.rules");
   mk.close();
   chmod((path / "mk-network").string().c_str(), S_IRWXU);
 
@@ -307,18 +324,109 @@ void network_join(const Context &ctx, const Service &svc, int pid) {
   rm.close();
   chmod((path / "rm-network").string().c_str(), S_IRWXU);
 
-  std::string out;
-  int exit_code = shell((path / "mk-network").string(), &out);
-  ctx.out() << out << "\n";
-  if (exit_code != 0) {
-    throw std::runtime_error("Unable to setup network");
+  if (use_scripts()) {
+    std::string out;
+    int exit_code = shell((path / "mk-network").string(), &out);
+    ctx.out() << out << "\n";
+    if (exit_code != 0) {
+      throw std::runtime_error("Unable to setup network");
+    }
+    return;
   }
+
+  network_join_native(joins, pid);
+  rules.apply();
 }
 
+// Each step is attempted even if an earlier one failed so a bad lease or
+// hosts file doesn't leave the service's port forwarding in place.
 bool network_destroy(const Context &ctx, const Service &svc) {
-  auto path = ctx.var_run / svc.name / "rm-network";
-  std::string out;
-  int exit_code = shell(path.string(), &out);
-  ctx.out() << out << "\n";
-  return exit_code == 0;
+  bool ok = true;
+  try {
+    HostsTable table(ctx.var_run / "etc_hosts");
+    table.set(svc.name, {});
+    table.save();
+  } catch (const std::exception &ex) {
+    ctx.out() << "Unable to update hosts file: " << ex.what() << "\n";
+    ok = false;
+  }
+  ok &= release_ips(ctx, svc);
+
+  if (use_scripts()) {
+    auto path = ctx.var_run / svc.name / "rm-network";
+    std::string out;
+    int exit_code = shell(path.string(), &out);
+    ctx.out() << out << "\n";
+    return ok && exit_code == 0;
+  }
+
+  // The veth pairs go away with the container's network namespace, so only
+  // the port forwarding rules need to be removed.
+  auto rules = ctx.var_run / svc.name / "iptables.rules";
+  if (!boost::filesystem::exists(rules)) {
+    return ok;
+  }
+  try {
+    FirewallRules::Load(rules).remove();
+    boost::filesystem::remove(rules);
+  } catch (const std::exception &ex) {
+    ctx.out() << "Unable to remove port forwarding: " << ex.what() << "\n";
+    return false;
+  }
+  return ok;
+}
+
+bool network_remove(const Context &ctx, const std::string &name) {
+  auto path = ctx.var_run / "networks" / name;
+  if (!boost::filesystem::exists(path / "info")) {
+    return true;
+  }
+  ctx.out() << "Removing network(" << name << ")\n";
+  LockedFile lock(path / ".lock");
+
+  bool ok = true;
+  if (use_scripts()) {
+    std::string out;
+    ok = shell((path / "rm-network").string(), &out) == 0;
+    ctx.out() << out << "\n";
+  } else {
+    auto rules = path / "iptables.rules";
+    try {
+      if (boost::filesystem::exists(rules)) {
+        FirewallRules::Load(rules).remove();
+        boost::filesystem::remove(rules);
+      }
+    } catch (const std::exception &ex) {
+      ctx.out() << "Unable to remove firewall rules: " << ex.what() << "\n";
+      ok = false;
+    }
+    try {
+      nlohmann::json data;
+      open_read(path / "info") >> data;
+      Netlink nl;
+      nl.del_link(data["bridge"].get<std::string>());
+      nl.commit();
+    } catch (const std::system_error &ex) {
+      if (ex.code().value() != ENODEV) {
+        ctx.out() << ex.what() << "\n";
+        ok = false;
+      }
+    } catch (const std::exception &ex) {
+      ctx.out() << ex.what() << "\n";
+      ok = false;
+    }
+  }
+
+  try {
+    subnet_release(ctx.var_run.parent_path() / "subnets",
+                   ctx.app + "/" + name);
+  } catch (const std::exception &ex) {
+    ctx.out() << "Unable to release subnet: " << ex.what() << "\n";
+    ok = false;
+  }
+  // Kept when something failed so the rules can still be found
+  if (ok) {
+    boost::filesystem::remove_all(path);
+  }
+  return ok;
 }
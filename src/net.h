@@ -8,3 +8,5 @@
 void network_render(const Context &ctx, const std::string &name);
 void network_join(const Context &ctx, const Service &svc, int pid);
 bool network_destroy(const Context &ctx, const Service &svc);
+// Take down a network rendered by network_render() once no service uses it
+bool network_remove(const Context &ctx, const std::string &name);
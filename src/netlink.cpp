@@ -0,0 +1,555 @@
+#include "netlink.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/veth.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+
+static void put_attr(std::vector<char> &buf, unsigned short type,
+                     const void *data, size_t len) {
+  struct rtattr rta {};
+  rta.rta_type = type;
+  rta.rta_len = RTA_LENGTH(len);
+  size_t off = buf.size();
+  buf.resize(off + RTA_SPACE(len), 0);
+  memcpy(&buf[off], &rta, sizeof(rta));
+  if (len > 0) {
+    memcpy(&buf[off + RTA_LENGTH(0)], data, len);
+  }
+}
+
+static void put_str(std::vector<char> &buf, unsigned short type,
+                    const std::string &val) {
+  put_attr(buf, type, val.c_str(), val.size() + 1);
+}
+
+static void put_u32(std::vector<char> &buf, unsigned short type,
+                    uint32_t val) {
+  put_attr(buf, type, &val, sizeof(val));
+}
+
+static size_t nest_start(std::vector<char> &buf, unsigned short type) {
+  size_t off = buf.size();
+  put_attr(buf, type, nullptr, 0);
+  return off;
+}
+
+static void nest_end(std::vector<char> &buf, size_t off) {
+  struct rtattr rta {};
+  memcpy(&rta, &buf[off], sizeof(rta));
+  rta.rta_len = buf.size() - off;
+  memcpy(&buf[off], &rta, sizeof(rta));
+}
+
+template <typename T> static void put_struct(std::vector<char> &buf, T &val) {
+  size_t off = buf.size();
+  buf.resize(off + NLMSG_ALIGN(sizeof(val)), 0);
+  memcpy(&buf[off], &val, sizeof(val));
+}
+
+struct ip_addr {
+  int family;
+  size_t len;
+  unsigned char data[16];
+};
+
+static ip_addr parse_addr(const std::string &ip) {
+  ip_addr addr{};
+  addr.family = ip.find(':') == std::string::npos ? AF_INET : AF_INET6;
+  addr.len = addr.family == AF_INET ? 4 : 16;
+  if (inet_pton(addr.family, ip.c_str(), addr.data) != 1) {
+    throw std::runtime_error("Invalid IP address: " + ip);
+  }
+  return addr;
+}
+
+int netns_open(int pid) {
+  std::string path = "/proc/" + std::to_string(pid) + "/ns/net";
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to open " + path);
+  }
+  return fd;
+}
+
+Netlink::Netlink(int netns_fd) : fd_(-1), seq_(1) {
+  // A netlink socket operates on the namespace it was created in, so hop into
+  // the target namespace just long enough to create it.
+  int orig = -1;
+  if (netns_fd >= 0) {
+    orig = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (orig < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to open current network namespace");
+    }
+    if (setns(netns_fd, CLONE_NEWNET) != 0) {
+      int err = errno;
+      close(orig);
+      throw std::system_error(err, std::generic_category(),
+                              "Unable to enter network namespace");
+    }
+  }
+  fd_ = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  int err = errno;
+  if (orig >= 0) {
+    if (setns(orig, CLONE_NEWNET) != 0) {
+      // We can't continue in the wrong namespace
+      perror("Unable to restore network namespace");
+      abort();
+    }
+    close(orig);
+  }
+  if (fd_ < 0) {
+    throw std::system_error(err, std::generic_category(),
+                            "Unable to create netlink socket");
+  }
+}
+
+Netlink::~Netlink() { close(fd_); }
+
+Netlink::Request &Netlink::queue(int type, int flags,
+                                 const std::string &what) {
+  pending_.emplace_back();
+  auto &r = pending_.back();
+  r.what = what;
+  struct nlmsghdr hdr {};
+  hdr.nlmsg_type = type;
+  hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+  put_struct(r.buf, hdr);
+  return r;
+}
+
+void Netlink::add_bridge(const std::string &name, bool up) {
+  auto &r = queue(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL,
+                  "create bridge " + name);
+  struct ifinfomsg ifi {};
+  ifi.ifi_family = AF_UNSPEC;
+  if (up) {
+    ifi.ifi_flags = IFF_UP;
+    ifi.ifi_change = IFF_UP;
+  }
+  put_struct(r.buf, ifi);
+  put_str(r.buf, IFLA_IFNAME, name);
+  auto info = nest_start(r.buf, IFLA_LINKINFO);
+  put_str(r.buf, IFLA_INFO_KIND, "bridge");
+  nest_end(r.buf, info);
+}
+
+void Netlink::add_veth(const std::string &name, int master,
+                       const std::string &peer, int peer_netns_fd) {
+  auto &r =
+      queue(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, "create veth " + name);
+  struct ifinfomsg ifi {};
+  ifi.ifi_family = AF_UNSPEC;
+  ifi.ifi_flags = IFF_UP;
+  ifi.ifi_change = IFF_UP;
+  put_struct(r.buf, ifi);
+  put_str(r.buf, IFLA_IFNAME, name);
+  put_u32(r.buf, IFLA_MASTER, master);
+  auto info = nest_start(r.buf, IFLA_LINKINFO);
+  put_str(r.buf, IFLA_INFO_KIND, "veth");
+  auto data = nest_start(r.buf, IFLA_INFO_DATA);
+  auto peer_info = nest_start(r.buf, VETH_INFO_PEER);
+  struct ifinfomsg peer_ifi {};
+  peer_ifi.ifi_family = AF_UNSPEC;
+  put_struct(r.buf, peer_ifi);
+  put_str(r.buf, IFLA_IFNAME, peer);
+  put_u32(r.buf, IFLA_NET_NS_FD, peer_netns_fd);
+  nest_end(r.buf, peer_info);
+  nest_end(r.buf, data);
+  nest_end(r.buf, info);
+}
+
+void Netlink::set_up(const std::string &name) {
+  auto &r = queue(RTM_NEWLINK, 0, "set " + name + " up");
+  struct ifinfomsg ifi {};
+  ifi.ifi_family = AF_UNSPEC;
+  ifi.ifi_flags = IFF_UP;
+  ifi.ifi_change = IFF_UP;
+  put_struct(r.buf, ifi);
+  put_str(r.buf, IFLA_IFNAME, name);
+}
+
+void Netlink::del_link(const std::string &name) {
+  auto &r = queue(RTM_DELLINK, 0, "delete " + name);
+  struct ifinfomsg ifi {};
+  ifi.ifi_family = AF_UNSPEC;
+  put_struct(r.buf, ifi);
+  put_str(r.buf, IFLA_IFNAME, name);
+}
+
+void Netlink::add_addr(int index, const std::string &ip, int prefixlen,
+                       bool broadcast) {
+  auto addr = parse_addr(ip);
+  auto &r = queue(RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL,
+                  "add " + ip + " to link " + std::to_string(index));
+  struct ifaddrmsg ifa {};
+  ifa.ifa_family = addr.family;
+  ifa.ifa_prefixlen = prefixlen;
+  ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+  ifa.ifa_index = index;
+  put_struct(r.buf, ifa);
+  put_attr(r.buf, IFA_LOCAL, addr.data, addr.len);
+  put_attr(r.buf, IFA_ADDRESS, addr.data, addr.len);
+  if (broadcast && addr.family == AF_INET) {
+    uint32_t v4;
+    memcpy(&v4, addr.data, sizeof(v4));
+    uint32_t mask = prefixlen == 0 ? 0 : htonl(~0U << (32 - prefixlen));
+    v4 |= ~mask;
+    put_attr(r.buf, IFA_BROADCAST, &v4, sizeof(v4));
+  }
+}
+
+void Netlink::add_default_route(const std::string &gateway) {
+  auto addr = parse_addr(gateway);
+  auto &r = queue(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE,
+                  "add default route via " + gateway);
+  struct rtmsg rtm {};
+  rtm.rtm_family = addr.family;
+  rtm.rtm_table = RT_TABLE_MAIN;
+  rtm.rtm_protocol = RTPROT_BOOT;
+  rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+  rtm.rtm_type = RTN_UNICAST;
+  put_struct(r.buf, rtm);
+  put_attr(r.buf, RTA_GATEWAY, addr.data, addr.len);
+}
+
+void Netlink::commit() {
+  if (pending_.empty()) {
+    return;
+  }
+  std::vector<Request> reqs;
+  reqs.swap(pending_);
+  send_recv(reqs);
+}
+
+void Netlink::send_recv(std::vector<Request> &reqs) {
+  unsigned base = seq_;
+  std::vector<struct iovec> iov(reqs.size());
+  for (size_t i = 0; i < reqs.size(); i++) {
+    struct nlmsghdr hdr {};
+    memcpy(&hdr, reqs[i].buf.data(), sizeof(hdr));
+    hdr.nlmsg_len = reqs[i].buf.size();
+    hdr.nlmsg_seq = seq_++;
+    memcpy(reqs[i].buf.data(), &hdr, sizeof(hdr));
+    iov[i].iov_base = reqs[i].buf.data();
+    iov[i].iov_len = reqs[i].buf.size();
+  }
+
+  struct sockaddr_nl kernel {};
+  kernel.nl_family = AF_NETLINK;
+  struct msghdr msg {};
+  msg.msg_name = &kernel;
+  msg.msg_namelen = sizeof(kernel);
+  msg.msg_iov = iov.data();
+  msg.msg_iovlen = iov.size();
+  if (sendmsg(fd_, &msg, 0) < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to send netlink request");
+  }
+
+  size_t acked = 0;
+  int first_err = 0;
+  std::string failed;
+  char buf[16384];
+  while (acked < reqs.size()) {
+    ssize_t len = recv(fd_, buf, sizeof(buf), 0);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    } else if (len < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to read netlink response");
+    }
+    for (auto *h = (struct nlmsghdr *)buf; NLMSG_OK(h, (size_t)len);
+         h = NLMSG_NEXT(h, len)) {
+      if (h->nlmsg_type != NLMSG_ERROR || h->nlmsg_seq < base ||
+          h->nlmsg_seq >= base + reqs.size()) {
+        continue;
+      }
+      acked++;
+      auto *err = (struct nlmsgerr *)NLMSG_DATA(h);
+      if (err->error != 0 && first_err == 0) {
+        first_err = -err->error;
+        failed = reqs[h->nlmsg_seq - base].what;
+      }
+    }
+  }
+  if (first_err != 0) {
+    throw std::system_error(first_err, std::generic_category(),
+                            "Unable to " + failed);
+  }
+}
+
+int Netlink::link_index(const std::string &name) {
+  std::vector<char> req;
+  struct nlmsghdr hdr {};
+  hdr.nlmsg_type = RTM_GETLINK;
+  hdr.nlmsg_flags = NLM_F_REQUEST;
+  hdr.nlmsg_seq = seq_++;
+  put_struct(req, hdr);
+  struct ifinfomsg ifi {};
+  ifi.ifi_family = AF_UNSPEC;
+  put_struct(req, ifi);
+  put_str(req, IFLA_IFNAME, name);
+  hdr.nlmsg_len = req.size();
+  memcpy(req.data(), &hdr, sizeof(hdr));
+
+  struct sockaddr_nl kernel {};
+  kernel.nl_family = AF_NETLINK;
+  if (sendto(fd_, req.data(), req.size(), 0, (struct sockaddr *)&kernel,
+             sizeof(kernel)) < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to send netlink request");
+  }
+
+  char buf[16384];
+  while (true) {
+    ssize_t len = recv(fd_, buf, sizeof(buf), 0);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    } else if (len < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to read netlink response");
+    }
+    for (auto *h = (struct nlmsghdr *)buf; NLMSG_OK(h, (size_t)len);
+         h = NLMSG_NEXT(h, len)) {
+      if (h->nlmsg_seq != hdr.nlmsg_seq) {
+        continue;
+      }
+      if (h->nlmsg_type == NLMSG_ERROR) {
+        auto *err = (struct nlmsgerr *)NLMSG_DATA(h);
+        throw std::system_error(-err->error, std::generic_category(),
+                                "Unable to find link " + name);
+      } else if (h->nlmsg_type == RTM_NEWLINK) {
+        return ((struct ifinfomsg *)NLMSG_DATA(h))->ifi_index;
+      }
+    }
+  }
+}
+
+static std::map<int, const struct rtattr *>
+parse_attrs(const struct rtattr *rta, int len) {
+  std::map<int, const struct rtattr *> attrs;
+  for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    attrs[rta->rta_type] = rta;
+  }
+  return attrs;
+}
+
+static std::string attr_str(const struct rtattr *rta) {
+  return std::string((const char *)RTA_DATA(rta),
+                     strnlen((const char *)RTA_DATA(rta), RTA_PAYLOAD(rta)));
+}
+
+static int inventory_socket(unsigned groups) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to create netlink socket");
+  }
+  struct sockaddr_nl local {};
+  local.nl_family = AF_NETLINK;
+  local.nl_groups = groups;
+  if (bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0) {
+    int err = errno;
+    close(fd);
+    throw std::system_error(err, std::generic_category(),
+                            "Unable to bind netlink socket");
+  }
+  return fd;
+}
+
+static void apply_msg(std::map<int, Link> &links, const struct nlmsghdr *h) {
+  if (h->nlmsg_type == RTM_NEWLINK || h->nlmsg_type == RTM_DELLINK) {
+    auto *ifi = (const struct ifinfomsg *)NLMSG_DATA(h);
+    if (h->nlmsg_type == RTM_DELLINK) {
+      links.erase(ifi->ifi_index);
+      return;
+    }
+    auto &link = links[ifi->ifi_index];
+    link.index = ifi->ifi_index;
+    link.flags = ifi->ifi_flags;
+    link.master = 0;
+    auto attrs = parse_attrs(IFLA_RTA(ifi), IFLA_PAYLOAD(h));
+    if (attrs.count(IFLA_IFNAME) > 0) {
+      link.name = attr_str(attrs[IFLA_IFNAME]);
+    }
+    if (attrs.count(IFLA_MASTER) > 0) {
+      link.master = *(const uint32_t *)RTA_DATA(attrs[IFLA_MASTER]);
+    }
+    if (attrs.count(IFLA_LINKINFO) > 0) {
+      auto *info = attrs[IFLA_LINKINFO];
+      auto nested = parse_attrs((const struct rtattr *)RTA_DATA(info),
+                                RTA_PAYLOAD(info));
+      if (nested.count(IFLA_INFO_KIND) > 0) {
+        link.kind = attr_str(nested[IFLA_INFO_KIND]);
+      }
+    }
+  } else if (h->nlmsg_type == RTM_NEWADDR || h->nlmsg_type == RTM_DELADDR) {
+    auto *ifa = (const struct ifaddrmsg *)NLMSG_DATA(h);
+    auto attrs = parse_attrs(IFA_RTA(ifa), IFA_PAYLOAD(h));
+    // IFA_ADDRESS is the peer's on point-to-point links
+    auto *rta = attrs.count(IFA_LOCAL) > 0 ? attrs[IFA_LOCAL]
+                                           : attrs.count(IFA_ADDRESS) > 0
+                                                 ? attrs[IFA_ADDRESS]
+                                                 : nullptr;
+    char buf[INET6_ADDRSTRLEN];
+    if (rta == nullptr ||
+        inet_ntop(ifa->ifa_family, RTA_DATA(rta), buf, sizeof(buf)) ==
+            nullptr) {
+      return;
+    }
+    if (h->nlmsg_type == RTM_DELADDR && links.count(ifa->ifa_index) == 0) {
+      return;
+    }
+    LinkAddr addr{ifa->ifa_family, buf, ifa->ifa_prefixlen};
+    auto &link = links[ifa->ifa_index];
+    link.index = ifa->ifa_index;
+    auto &addrs = link.addrs;
+    for (auto it = addrs.begin(); it != addrs.end(); it++) {
+      if (it->ip == addr.ip && it->prefixlen == addr.prefixlen) {
+        addrs.erase(it);
+        break;
+      }
+    }
+    if (h->nlmsg_type == RTM_NEWADDR) {
+      addrs.push_back(addr);
+    }
+  }
+}
+
+LinkInventory::LinkInventory(bool watch) : fd_(-1) {
+  // Subscribe before dumping so nothing that changes in between is missed
+  if (watch) {
+    fd_ = inventory_socket(RTMGRP_LINK | RTMGRP_IPV4_IFADDR |
+                           RTMGRP_IPV6_IFADDR);
+  }
+  try {
+    load();
+  } catch (...) {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    throw;
+  }
+}
+
+LinkInventory::~LinkInventory() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+// Dump the links and then their addresses over a socket of its own so the
+// replies aren't interleaved with notifications
+void LinkInventory::load() {
+  int fd = inventory_socket(0);
+  std::map<int, Link> links;
+  try {
+    for (int type : {RTM_GETLINK, RTM_GETADDR}) {
+      std::vector<char> req;
+      struct nlmsghdr hdr {};
+      hdr.nlmsg_type = type;
+      hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+      hdr.nlmsg_seq = type;
+      put_struct(req, hdr);
+      if (type == RTM_GETLINK) {
+        struct ifinfomsg ifi {};
+        ifi.ifi_family = AF_UNSPEC;
+        put_struct(req, ifi);
+      } else {
+        struct ifaddrmsg ifa {};
+        ifa.ifa_family = AF_UNSPEC;
+        put_struct(req, ifa);
+      }
+      hdr.nlmsg_len = req.size();
+      memcpy(req.data(), &hdr, sizeof(hdr));
+      if (send(fd, req.data(), req.size(), 0) < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "Unable to send netlink request");
+      }
+
+      std::vector<char> buf(65536);
+      bool done = false;
+      while (!done) {
+        ssize_t len = recv(fd, buf.data(), buf.size(), 0);
+        if (len < 0 && errno == EINTR) {
+          continue;
+        } else if (len < 0) {
+          throw std::system_error(errno, std::generic_category(),
+                                  "Unable to read netlink response");
+        }
+        for (auto *h = (struct nlmsghdr *)buf.data();
+             NLMSG_OK(h, (size_t)len); h = NLMSG_NEXT(h, len)) {
+          if (h->nlmsg_type == NLMSG_DONE) {
+            done = true;
+            break;
+          } else if (h->nlmsg_type == NLMSG_ERROR) {
+            auto *err = (struct nlmsgerr *)NLMSG_DATA(h);
+            throw std::system_error(-err->error, std::generic_category(),
+                                    "Unable to list network interfaces");
+          }
+          apply_msg(links, h);
+        }
+      }
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  std::lock_guard<std::mutex> guard(lock_);
+  links_.swap(links);
+}
+
+void LinkInventory::update() {
+  if (fd_ < 0) {
+    return;
+  }
+  std::vector<char> buf(65536);
+  while (true) {
+    ssize_t len = recv(fd_, buf.data(), buf.size(), MSG_DONTWAIT);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    } else if (len < 0 && errno == ENOBUFS) {
+      // Notifications were dropped so start over
+      load();
+      continue;
+    } else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else if (len < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to read netlink notifications");
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    for (auto *h = (struct nlmsghdr *)buf.data(); NLMSG_OK(h, (size_t)len);
+         h = NLMSG_NEXT(h, len)) {
+      apply_msg(links_, h);
+    }
+  }
+}
+
+std::map<int, Link> LinkInventory::links() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return links_;
+}
+
+std::vector<std::string> LinkInventory::addresses() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  std::vector<std::string> addrs;
+  for (const auto &it : links_) {
+    for (const auto &addr : it.second.addrs) {
+      addrs.push_back(addr.ip);
+    }
+  }
+  return addrs;
+}
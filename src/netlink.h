@@ -0,0 +1,98 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A minimal rtnetlink client. Requests are queued and then sent with a single
+// sendmsg() by commit() which collects the ACK of each one. Links are
+// referenced by name where the kernel allows it, the requests that need an
+// index take one looked up by link_index() before queueing.
+class Netlink {
+public:
+  // Open a socket in the current network namespace, or in the namespace
+  // referred to by netns_fd.
+  explicit Netlink(int netns_fd = -1);
+  ~Netlink();
+  Netlink(const Netlink &) = delete;
+  Netlink &operator=(const Netlink &) = delete;
+
+  void add_bridge(const std::string &name, bool up);
+  // Create a veth pair enslaved to the link `master`, with the peer placed in
+  // the namespace `peer_netns_fd`.
+  void add_veth(const std::string &name, int master, const std::string &peer,
+                int peer_netns_fd);
+  void set_up(const std::string &name);
+  void del_link(const std::string &name);
+  void add_addr(int index, const std::string &ip, int prefixlen,
+                bool broadcast);
+  void add_default_route(const std::string &gateway);
+
+  // Send all queued requests. Throws on the first request that failed.
+  void commit();
+
+  // The index of an existing link. Queued requests aren't sent first, so
+  // links they create must be committed before being looked up.
+  int link_index(const std::string &name);
+
+private:
+  struct Request {
+    std::vector<char> buf;
+    std::string what;
+  };
+  Request &queue(int type, int flags, const std::string &what);
+  void send_recv(std::vector<Request> &reqs);
+
+  int fd_;
+  unsigned seq_;
+  std::vector<Request> pending_;
+};
+
+// Open /proc/<pid>/ns/net. The caller owns the file descriptor.
+int netns_open(int pid);
+
+struct LinkAddr {
+  int family;
+  std::string ip;
+  int prefixlen;
+};
+
+struct Link {
+  int index;
+  std::string name;
+  std::string kind; // "bridge", "veth", ... or empty for physical links
+  unsigned flags;
+  int master; // 0 if the link isn't enslaved
+  std::vector<LinkAddr> addrs;
+};
+
+// The links of the current network namespace with all their addresses,
+// loaded with one dump of each. With `watch` it also subscribes to link and
+// address notifications, which update() applies so a long-lived process
+// never has to enumerate the host again. Safe to read from other threads
+// while update() runs.
+class LinkInventory {
+public:
+  explicit LinkInventory(bool watch = false);
+  ~LinkInventory();
+  LinkInventory(const LinkInventory &) = delete;
+  LinkInventory &operator=(const LinkInventory &) = delete;
+
+  // Readable when there are notifications for update(), -1 unless watching
+  int fd() const { return fd_; }
+  // Apply the pending notifications without blocking
+  void update();
+
+  // By index
+  std::map<int, Link> links() const;
+  // Every address on every link
+  std::vector<std::string> addresses() const;
+
+private:
+  void load();
+
+  int fd_;
+  mutable std::mutex lock_;
+  std::map<int, Link> links_;
+};
@@ -1,26 +1,31 @@
 #include "oci-hooks.h"
 
 #include <boost/algorithm/string.hpp>
+#include <signal.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 
 #include "json.h"
 
 #include "context.h"
+#include "daemon.h"
 #include "net.h"
 #include "project.h"
+#include "registry.h"
+#include "seccomp.h"
+#include "state.h"
+#include "users.h"
 #include "utils.h"
 
-void oci_createRuntime(const std::string &app_name, const std::string &svc) {
-  auto ctx = Context::Load(app_name);
-  auto proj = ProjectDefinition::Load("docker-compose.json");
+void oci_createRuntime(Context ctx, const ProjectDefinition &proj,
+                       const std::string &svc, const std::string &state) {
   auto s = proj.get_service(svc);
 
   std::ofstream logf((ctx.var_run / svc / "createRuntime.log").string());
   ctx.out_ = &logf;
 
   // load oci hook data
-  nlohmann::json data;
-  std::cin >> data;
+  auto data = nlohmann::json::parse(state);
   int pid = data["pid"].get<int>();
 
   for (const auto &net : s.networks) {
@@ -33,20 +38,48 @@ void oci_createRuntime(const std::string &app_name, const std::string &svc) {
     logf << ex.what() << "\n";
     throw ex;
   }
+  AppState::Running(ctx, svc, pid);
 }
 
-void oci_poststop(const std::string &app_name, const std::string &svc) {
+void oci_createRuntime(const std::string &app_name, const std::string &svc) {
   auto ctx = Context::Load(app_name);
-  auto proj = ProjectDefinition::Load("docker-compose.json");
+  std::string state((std::istreambuf_iterator<char>(std::cin)),
+                    std::istreambuf_iterator<char>());
+
+  nlohmann::json resp;
+  nlohmann::json req = {
+      {"cmd", "createRuntime"}, {"service", svc}, {"state", state}};
+  if (!daemon_call(ctx, req, resp)) {
+    auto proj = ProjectDefinition::Load("docker-compose.json");
+    oci_createRuntime(ctx, proj, svc, state);
+  }
+}
+
+// Whether `capp-run up` is supervising the service and may restart it, in
+// which case it owns the rootfs mount
+static bool supervised(const Context &ctx, const std::string &svc) {
+  int pid = -1;
+  try {
+    open_read(ctx.var_run / svc / "supervisor.pid") >> pid;
+  } catch (const std::exception &ex) {
+    return false;
+  }
+  return pid > 0 && kill(pid, 0) == 0;
+}
+
+void oci_poststop(Context ctx, const ProjectDefinition &proj,
+                  const std::string &svc) {
   auto s = proj.get_service(svc);
 
   std::ofstream logf((ctx.var_run / svc / "poststop.log").string());
   ctx.out_ = &logf;
 
+  AppState::Stopped(ctx, svc);
+
   std::string err;
 
   auto rootfs = ctx.var_lib / "mounts" / svc / "rootfs";
-  if (umount(rootfs.c_str()) != 0) {
+  if (!supervised(ctx, svc) && umount(rootfs.c_str()) != 0) {
     err = "Unable to unmount container rootfs";
   }
 
@@ -62,86 +95,58 @@ void oci_poststop(const std::string &app_name, const std::string &svc) {
   }
 }
 
-struct user {
-  int uid;
-  int gid;
-};
-
-static void find_user(const boost::filesystem::path &passwd,
-                      const std::string &user, struct user &entry) {
-  auto infile = open_read(passwd);
-  std::string line;
-  while (std::getline(infile, line)) {
-    std::vector<std::string> parts;
-    boost::split(parts, line, boost::is_any_of(":"));
-    if (parts[0] == user) {
-      entry.uid = std::stoi(parts[2]);
-      entry.gid = std::stoi(parts[3]);
-      return;
-    }
-  }
-  throw std::runtime_error("Unable to find user");
-}
-
-static int find_group(const boost::filesystem::path &grp,
-                      const std::string &group) {
-  auto infile = open_read(grp);
-  std::string line;
-  while (std::getline(infile, line)) {
-    std::vector<std::string> parts;
-    boost::split(parts, line, boost::is_any_of(":"));
-    if (parts[0] == group) {
-      return std::stoi(parts[2]);
-    }
+void oci_poststop(const std::string &app_name, const std::string &svc) {
+  auto ctx = Context::Load(app_name);
+  nlohmann::json resp;
+  if (!daemon_call(ctx, {{"cmd", "poststop"}, {"service", svc}}, resp)) {
+    auto proj = ProjectDefinition::Load("docker-compose.json");
+    oci_poststop(ctx, proj, svc);
   }
-  throw std::runtime_error("Unable to find group");
 }
 
 static void fix_user(const std::string &user,
                      const boost::filesystem::path &rootfs,
                      nlohmann::json &spec) {
   if (!user.empty()) {
-    int uid = 0;
-    int gid = 0;
-    bool gid_set = false;
-
-    std::vector<std::string> parts;
-    boost::split(parts, user, boost::is_any_of(":"));
-    if (parts.size() == 2) {
-      try {
-        gid = std::stoi(parts[1]);
-        gid_set = true;
-      } catch (const std::exception &ex) {
-        gid = find_group(rootfs / "etc/group", parts[1]);
-        gid_set = true;
+    uint32_t uid, gid;
+    std::vector<uint32_t> additional;
+    UserDb::Load(rootfs).resolve(user, uid, gid, additional);
+
+    auto &entry = spec["process"]["user"];
+    entry["uid"] = uid;
+    entry["gid"] = gid;
+    // Keep any the spec already asks for
+    auto gids = entry.value("additionalGids", std::vector<uint32_t>());
+    for (auto g : additional) {
+      if (std::find(gids.begin(), gids.end(), g) == gids.end()) {
+        gids.push_back(g);
       }
     }
-    try {
-      uid = std::stoi(parts[0]);
-    } catch (const std::exception &ex) {
-      struct user entry;
-      find_user(rootfs / "etc/passwd", parts[0], entry);
-      uid = entry.uid;
-      if (!gid_set) {
-        gid = entry.gid;
-      }
+    if (!gids.empty()) {
+      entry["additionalGids"] = gids;
+    }
+  }
+}
+
+// Bind sources relative to the compose-app directory are created if missing
+static void create_bind_sources(const std::vector<std::string> &sources) {
+  for (const auto &source : sources) {
+    if (!boost::filesystem::exists(source)) {
+      boost::filesystem::create_directories(source);
     }
-    spec["process"]["user"]["uid"] = uid;
-    spec["process"]["user"]["gid"] = gid;
   }
 }
 
-static void fix_mounts(const boost::filesystem::path &volumes_path,
-                       const std::vector<Volume> &volumes,
-                       nlohmann::json &spec) {
+// Returns the relative bind sources of the spec's mounts
+static std::vector<std::string>
+fix_mounts(const boost::filesystem::path &volumes_path,
+           const std::vector<Volume> &volumes, nlohmann::json &spec) {
+  std::vector<std::string> binds;
   for (auto &m : spec["mounts"]) {
     auto source = m["source"].get<std::string>();
     if (m["type"].get<std::string>() == "bind") {
       if (source[0] != '/') {
-        // source is relative to the compose-app directory
-        if (!boost::filesystem::exists(source)) {
-          boost::filesystem::create_directories(source);
-        }
+        binds.push_back(source);
       }
     } else if (m["type"].get<std::string>() == "volume") {
       for (const auto &v : volumes) {
@@ -153,10 +158,12 @@ static void fix_mounts(const boost::filesystem::path &volumes_path,
       }
     }
   }
+  create_bind_sources(binds);
+  return binds;
 }
 
-static void add_seccomp(const std::vector<std::string> sec_opts,
-                        nlohmann::json &spec) {
+// The seccomp profile for a service, empty when it's unconfined
+static std::string seccomp_profile(const std::vector<std::string> &sec_opts) {
   // by default load the one provided by the bundle, which is
   // capp-pub gets from docker
   std::string profile = ".specs/.default-secomp.json";
@@ -164,19 +171,80 @@ static void add_seccomp(const std::vector<std::string> sec_opts,
     if (opt.rfind("seccomp:", 0) == 0) {
       profile = opt.substr(8);
       if (profile == "unconfined") {
-        return;
+        return "";
       }
       break;
     } else {
       throw std::runtime_error("Unsupport security opt: " + opt);
     }
   }
+  return profile;
+}
 
+static void add_seccomp(const std::vector<std::string> sec_opts,
+                        const boost::filesystem::path &cache,
+                        nlohmann::json &spec) {
+  auto profile = seccomp_profile(sec_opts);
+  if (profile.empty()) {
+    return;
+  }
+  auto precompiled = seccomp_precompile(profile, cache);
+  if (!precompiled.is_null()) {
+    // crun loads this instead of compiling the profile on every start
+    spec["annotations"]["run.oci.seccomp_bpf_data"] = precompiled["bpf"];
+    spec["linux"]["seccomp"] = precompiled["seccomp"];
+    return;
+  }
   nlohmann::json seccomp;
   open_read(profile) >> seccomp;
   spec["linux"]["seccomp"] = seccomp;
 }
 
+// Identify a file's content by its inode, size and mtime rather than reading
+// it. Seccomp profiles in particular are big and slow to parse.
+static void fingerprint(std::string &key, const boost::filesystem::path &p) {
+  struct stat st;
+  key += p.string();
+  if (stat(p.c_str(), &st) == 0) {
+    key += " " + std::to_string(st.st_dev) + " " + std::to_string(st.st_ino) +
+           " " + std::to_string(st.st_size) + " " +
+           std::to_string(st.st_mtim.tv_sec) + "." +
+           std::to_string(st.st_mtim.tv_nsec);
+  } else {
+    key += " missing";
+  }
+  key += "\n";
+}
+
+// A digest of everything that goes into a service's config.json
+static std::string ocispec_key(
+    const std::string &app_name, const boost::filesystem::path &volumes_path,
+    const Service &svc, const std::vector<Volume> &volumes,
+    const boost::filesystem::path &spec, const boost::filesystem::path &rootfs,
+    const boost::filesystem::path &etc_hosts,
+    const boost::filesystem::path &resolv_conf,
+    const boost::filesystem::path &exe) {
+  std::string key = app_name + "\n" + svc.name + "\n" + svc.user + "\n";
+  for (const auto &opt : svc.security_opts) {
+    key += "security_opt " + opt + "\n";
+  }
+  for (const auto &v : volumes) {
+    key += "volume " + v.name + "\n";
+  }
+  key += volumes_path.string() + "\n" + rootfs.string() + "\n" +
+         etc_hosts.string() + "\n" + resolv_conf.string() + "\n";
+
+  fingerprint(key, exe);
+  fingerprint(key, spec);
+  fingerprint(key, rootfs / "etc/passwd");
+  fingerprint(key, rootfs / "etc/group");
+  auto profile = seccomp_profile(svc.security_opts);
+  if (!profile.empty()) {
+    fingerprint(key, profile);
+  }
+  return sha256_digest(key);
+}
+
 void ocispec_create(const std::string &app_name,
                     const boost::filesystem::path &volumes_path,
                     const Service &svc, const std::vector<Volume> &volumes,
@@ -184,9 +252,36 @@ void ocispec_create(const std::string &app_name,
                     const boost::filesystem::path &out,
                     const boost::filesystem::path &rootfs,
                     const boost::filesystem::path &etc_hosts,
-                    const boost::filesystem::path &resolv_conf) {
+                    const boost::filesystem::path &resolv_conf,
+                    const boost::filesystem::path &seccomp_cache) {
 
   auto exe = boost::filesystem::read_symlink("/proc/self/exe");
+
+  // Skip regenerating the config when none of its inputs have changed. The
+  // digest file also lists the relative bind sources, which are created on
+  // every call as they may have been removed since.
+  auto digest = ocispec_key(app_name, volumes_path, svc, volumes, spec, rootfs,
+                            etc_hosts, resolv_conf, exe);
+  auto digest_path = boost::filesystem::path(out.string() + ".digest");
+  if (boost::filesystem::exists(out)) {
+    std::string prev;
+    std::vector<std::string> binds;
+    try {
+      auto file = open_read(digest_path);
+      getline(file, prev);
+      std::string line;
+      while (getline(file, line)) {
+        binds.push_back(line);
+      }
+    } catch (const std::exception &ex) {
+    }
+    if (prev == digest) {
+      create_bind_sources(binds);
+      return;
+    }
+  }
+  boost::filesystem::remove(digest_path);
+
   nlohmann::json data;
   open_read(spec) >> data;
   data["root"]["path"] = rootfs.string();
@@ -208,9 +303,9 @@ void ocispec_create(const std::string &app_name,
 
   fix_user(svc.user, rootfs, data);
 
-  fix_mounts(volumes_path, volumes, data);
+  auto binds = fix_mounts(volumes_path, volumes, data);
 
-  add_seccomp(svc.security_opts, data);
+  add_seccomp(svc.security_opts, seccomp_cache, data);
 
   entry = {
       {"destination", "/etc/hosts"},
@@ -226,4 +321,9 @@ void ocispec_create(const std::string &app_name,
   data["mounts"].emplace_back(entry);
 
   open_write(out) << data;
+  auto digest_file = open_write(digest_path);
+  digest_file << digest << "\n";
+  for (const auto &bind : binds) {
+    digest_file << bind << "\n";
+  }
 }
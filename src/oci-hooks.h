@@ -3,11 +3,18 @@
 #include <boost/filesystem.hpp>
 #include <string>
 
+#include "context.h"
 #include "project.h"
 
 void oci_createRuntime(const std::string &app_name, const std::string &svc);
 void oci_poststop(const std::string &app_name, const std::string &svc);
 
+// `state` is the OCI state JSON crun passes to the hook on stdin
+void oci_createRuntime(Context ctx, const ProjectDefinition &proj,
+                       const std::string &svc, const std::string &state);
+void oci_poststop(Context ctx, const ProjectDefinition &proj,
+                  const std::string &svc);
+
 void ocispec_create(const std::string &app_name,
                     const boost::filesystem::path &volumes_path,
                     const Service &svc, const std::vector<Volume> &volumes,
@@ -15,4 +22,5 @@ void ocispec_create(const std::string &app_name,
                     const boost::filesystem::path &out,
                     const boost::filesystem::path &rootfs,
                     const boost::filesystem::path &etc_hosts,
-                    const boost::filesystem::path &resolv_conf);
+                    const boost::filesystem::path &resolv_conf,
+                    const boost::filesystem::path &seccomp_cache);
@@ -0,0 +1,234 @@
+#include "overlay.h"
+
+#include <fcntl.h>
+#include <memory>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef FSCONFIG_SET_FLAG
+#define FSCONFIG_SET_FLAG 0
+#define FSCONFIG_SET_STRING 1
+#define FSCONFIG_CMD_CREATE 6
+#endif
+
+// fsconfig() copies at most this much of a value
+static const size_t max_fsconfig_value = 255;
+
+// How directories are named in overlay options
+class DirNames {
+public:
+  ~DirNames() {
+    for (auto fd : fds_) {
+      close(fd);
+    }
+  }
+
+  // The path itself when that's safe to use, keeping mountinfo readable
+  std::string name(const boost::filesystem::path &dir) {
+    if (dir.string().find_first_of(",:\\ \t\n") == std::string::npos) {
+      return dir.string();
+    }
+    return fd_name(dir);
+  }
+
+  // A short name for when space is tight
+  std::string fd_name(const boost::filesystem::path &dir) {
+    int fd = open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to open " + dir.string());
+    }
+    fds_.push_back(fd);
+    return "/proc/self/fd/" + std::to_string(fd);
+  }
+
+private:
+  std::vector<int> fds_;
+};
+
+static void check_options(const std::vector<std::string> &options) {
+  static const char *allowed[] = {"index=", "metacopy=", "redirect_dir=",
+                                  "xino=", "nfs_export="};
+  for (const auto &opt : options) {
+    bool ok = opt == "volatile" || opt == "userxattr";
+    for (const auto &prefix : allowed) {
+      ok |= opt.rfind(prefix, 0) == 0;
+    }
+    if (!ok) {
+      throw std::runtime_error("Unsupported overlay option: " + opt);
+    }
+  }
+}
+
+#ifdef SYS_fsopen
+static int fsconfig(int fd, unsigned int cmd, const char *key,
+                    const char *value) {
+  return syscall(SYS_fsconfig, fd, cmd, key, value, 0);
+}
+
+// The kernel explains why a mount failed through the fs context
+static std::string fs_errors(int fd) {
+  std::string msgs;
+  char buf[512];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf) - 1)) > 0) {
+    buf[n] = '\0';
+    msgs += msgs.empty() ? ": " : "; ";
+    // each is "<e|w|i> <message>"
+    msgs += n > 2 ? buf + 2 : buf;
+  }
+  return msgs;
+}
+
+// Returns false if the new mount API can't do this mount and mount(2)
+// should be tried instead
+static bool fs_mount(const std::vector<boost::filesystem::path> &lower,
+                     const boost::filesystem::path &upper,
+                     const boost::filesystem::path &work,
+                     const boost::filesystem::path &target,
+                     const std::vector<std::string> &options,
+                     DirNames &names) {
+  int fd = syscall(SYS_fsopen, "overlay", FSOPEN_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  std::unique_ptr<int, void (*)(int *)> guard(&fd,
+                                               [](int *fd) { close(*fd); });
+
+  // "lowerdir+" (linux 6.8) takes a layer at a time, older kernels need
+  // them all in one value
+  bool ok = true;
+  for (const auto &dir : lower) {
+    if (fsconfig(fd, FSCONFIG_SET_STRING, "lowerdir+",
+                 names.name(dir).c_str()) != 0) {
+      ok = false;
+      break;
+    }
+  }
+  if (!ok) {
+    close(fd);
+    fd = syscall(SYS_fsopen, "overlay", FSOPEN_CLOEXEC);
+    std::string lowerdir;
+    for (const auto &dir : lower) {
+      lowerdir += (lowerdir.empty() ? "" : ":") + names.fd_name(dir);
+    }
+    if (fd < 0 || lowerdir.size() > max_fsconfig_value ||
+        fsconfig(fd, FSCONFIG_SET_STRING, "lowerdir", lowerdir.c_str()) != 0) {
+      return false;
+    }
+  }
+
+  auto upperdir = names.name(upper);
+  auto workdir = names.name(work);
+  if (upperdir.size() > max_fsconfig_value) {
+    upperdir = names.fd_name(upper);
+  }
+  if (workdir.size() > max_fsconfig_value) {
+    workdir = names.fd_name(work);
+  }
+  if (fsconfig(fd, FSCONFIG_SET_STRING, "source", "overlay") != 0 ||
+      fsconfig(fd, FSCONFIG_SET_STRING, "upperdir", upperdir.c_str()) != 0 ||
+      fsconfig(fd, FSCONFIG_SET_STRING, "workdir", workdir.c_str()) != 0) {
+    int err = errno;
+    throw std::system_error(err, std::generic_category(),
+                            "Unable to configure overlayfs" + fs_errors(fd));
+  }
+  for (const auto &opt : options) {
+    auto eq = opt.find('=');
+    int rc = eq == std::string::npos
+                 ? fsconfig(fd, FSCONFIG_SET_FLAG, opt.c_str(), nullptr)
+                 : fsconfig(fd, FSCONFIG_SET_STRING, opt.substr(0, eq).c_str(),
+                            opt.substr(eq + 1).c_str());
+    if (rc != 0) {
+      int err = errno;
+      throw std::system_error(err, std::generic_category(),
+                              "Unable to set overlay option " + opt +
+                                  fs_errors(fd));
+    }
+  }
+  if (fsconfig(fd, FSCONFIG_CMD_CREATE, nullptr, nullptr) != 0) {
+    int err = errno;
+    throw std::system_error(err, std::generic_category(),
+                            "Unable to mount overlayfs" + fs_errors(fd));
+  }
+
+  int mnt = syscall(SYS_fsmount, fd, FSMOUNT_CLOEXEC, 0);
+  if (mnt < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to mount overlayfs");
+  }
+  int rc = syscall(SYS_move_mount, mnt, "", AT_FDCWD, target.c_str(),
+                   MOVE_MOUNT_F_EMPTY_PATH);
+  int err = errno;
+  close(mnt);
+  if (rc != 0) {
+    throw std::system_error(err, std::generic_category(),
+                            "Unable to mount overlayfs on " + target.string());
+  }
+  return true;
+}
+#endif
+
+static std::string mount_data(const std::vector<std::string> &lower,
+                              const std::string &upper,
+                              const std::string &work,
+                              const std::vector<std::string> &options) {
+  std::string data = "lowerdir=";
+  for (size_t i = 0; i < lower.size(); i++) {
+    data += (i == 0 ? "" : ":") + lower[i];
+  }
+  data += ",upperdir=" + upper + ",workdir=" + work;
+  for (const auto &opt : options) {
+    data += "," + opt;
+  }
+  return data;
+}
+
+void overlay_mount(const std::vector<boost::filesystem::path> &lower,
+                   const boost::filesystem::path &upper,
+                   const boost::filesystem::path &work,
+                   const boost::filesystem::path &target,
+                   const std::vector<std::string> &options) {
+  check_options(options);
+
+  DirNames names;
+#ifdef SYS_fsopen
+  if (fs_mount(lower, upper, work, target, options, names)) {
+    return;
+  }
+#endif
+
+  // mount(2) takes a page of options
+  std::vector<std::string> lowerdirs;
+  for (const auto &dir : lower) {
+    lowerdirs.push_back(names.name(dir));
+  }
+  auto data = mount_data(lowerdirs, names.name(upper), names.name(work),
+                         options);
+  if (data.size() >= (size_t)getpagesize()) {
+    lowerdirs.clear();
+    for (const auto &dir : lower) {
+      lowerdirs.push_back(names.fd_name(dir));
+    }
+    data = mount_data(lowerdirs, names.fd_name(upper), names.fd_name(work),
+                      options);
+  }
+  if (data.size() >= (size_t)getpagesize()) {
+    throw std::runtime_error("Too many layers to mount overlayfs");
+  }
+  if (mount("overlay", target.c_str(), "overlay", 0, data.c_str()) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to mount overlayfs");
+  }
+}
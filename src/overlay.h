@@ -0,0 +1,18 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <string>
+#include <vector>
+
+// Mount an overlay of `lower` (topmost first) and `upper` at `target` without
+// running mount(8). The new mount API is used when the kernel has it, adding
+// layers one at a time with "lowerdir+" so there's no limit on how many an
+// image has. Otherwise mount(2) is used. Directories whose paths contain
+// commas, colons or spaces, or that don't fit, are passed as /proc/self/fd
+// paths. `options` may be any of volatile, userxattr, index=, metacopy=,
+// redirect_dir=, xino= and nfs_export=.
+void overlay_mount(const std::vector<boost::filesystem::path> &lower,
+                   const boost::filesystem::path &upper,
+                   const boost::filesystem::path &work,
+                   const boost::filesystem::path &target,
+                   const std::vector<std::string> &options);
@@ -1,5 +1,6 @@
 #include "project.h"
 
+#include <boost/algorithm/string.hpp>
 #include <boost/process.hpp>
 #include <iostream>
 #include <sys/stat.h>
@@ -119,13 +120,43 @@ ProjectDefinition ProjectDefinition::Load(const std::string &path) {
       svc.dns_opts = dns.get<std::vector<std::string>>();
     }
 
+    // Either a list of names or a map of name -> {condition: ...}
+    auto deps = item.value()["depends_on"];
+    if (deps.is_array()) {
+      svc.depends_on = deps.get<std::vector<std::string>>();
+    } else if (deps.is_object()) {
+      for (const auto &dep : deps.items()) {
+        svc.depends_on.emplace_back(dep.key());
+      }
+    }
+
+    auto restart = item.value()["restart"];
+    svc.restart = restart.is_string() ? restart.get<std::string>() : "no";
+
+    // A list or a comma separated string
+    auto overlay_opts = item.value()["x-overlay-options"];
+    if (overlay_opts.is_array()) {
+      svc.overlay_opts = overlay_opts.get<std::vector<std::string>>();
+    } else if (overlay_opts.is_string()) {
+      // "volatile, index=off" is as valid as "volatile,index=off"
+      std::vector<std::string> opts;
+      boost::split(opts, overlay_opts.get<std::string>(),
+                   boost::is_any_of(","));
+      for (auto &opt : opts) {
+        boost::trim(opt);
+        if (!opt.empty()) {
+          svc.overlay_opts.push_back(opt);
+        }
+      }
+    }
+
     def.services.push_back(svc);
   }
 
   return def;
 }
 
-Service ProjectDefinition::get_service(const std::string &name) {
+Service ProjectDefinition::get_service(const std::string &name) const {
   for (const auto &s : services) {
     if (s.name == name) {
       return s;
@@ -34,10 +34,14 @@ struct Service {
   std::vector<std::string> dns_servers;
   std::vector<std::string> dns_search;
   std::vector<std::string> dns_opts;
+  std::vector<std::string> depends_on;
+  std::string restart; // no, always, on-failure[:max] or unless-stopped
+  // Extra overlayfs mount options from x-overlay-options, e.g. volatile
+  std::vector<std::string> overlay_opts;
 };
 
 struct ProjectDefinition {
-  Service get_service(const std::string &name);
+  Service get_service(const std::string &name) const;
 
   std::vector<Network> networks;
   std::vector<Volume> volumes;
@@ -0,0 +1,569 @@
+#include "registry.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/process.hpp>
+#include <curl/curl.h>
+#include <functional>
+#include <mutex>
+#include <openssl/evp.h>
+
+#include "json.h"
+
+#include "utils.h"
+
+static const char *manifest_types =
+    "Accept: application/vnd.oci.image.index.v1+json, "
+    "application/vnd.oci.image.manifest.v1+json, "
+    "application/vnd.docker.distribution.manifest.list.v2+json, "
+    "application/vnd.docker.distribution.manifest.v2+json";
+
+class Sha256 {
+public:
+  Sha256() : ctx_(EVP_MD_CTX_new()) {
+    EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr);
+  }
+  ~Sha256() { EVP_MD_CTX_free(ctx_); }
+  void update(const void *buf, size_t len) {
+    EVP_DigestUpdate(ctx_, buf, len);
+  }
+  std::string digest() {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(ctx_, md, &len);
+    std::string hex = "sha256:";
+    char buf[3];
+    for (unsigned int i = 0; i < len; i++) {
+      snprintf(buf, sizeof(buf), "%02x", md[i]);
+      hex += buf;
+    }
+    return hex;
+  }
+
+private:
+  EVP_MD_CTX *ctx_;
+};
+
+std::string sha256_digest(const std::string &buf) {
+  Sha256 sha;
+  sha.update(buf.data(), buf.size());
+  return sha.digest();
+}
+
+// Writes a blob to disk while checking it matches its digest
+class BlobWriter {
+public:
+  BlobWriter(const Layer &layer, const boost::filesystem::path &dst,
+             const std::function<void(size_t)> &progress)
+      : layer_(layer), dst_(dst), tmp_(dst.string() + ".part"),
+        out_(open_write(tmp_)), progress_(progress) {
+    if (layer.digest.rfind("sha256:", 0) != 0) {
+      throw std::runtime_error("Unsupported digest: " + layer.digest);
+    }
+  }
+  void write(const char *buf, size_t len) {
+    sha_.update(buf, len);
+    out_.write(buf, len);
+    if (progress_) {
+      progress_(len);
+    }
+  }
+  void commit() {
+    out_.close();
+    if (out_.fail()) {
+      throw std::runtime_error("Unable to write " + tmp_.string());
+    }
+    auto digest = sha_.digest();
+    if (digest != layer_.digest) {
+      boost::filesystem::remove(tmp_);
+      throw std::runtime_error("Digest mismatch for " + layer_.digest +
+                               ": got " + digest);
+    }
+    boost::filesystem::rename(tmp_, dst_);
+  }
+
+private:
+  const Layer &layer_;
+  boost::filesystem::path dst_;
+  boost::filesystem::path tmp_;
+  std::ofstream out_;
+  const std::function<void(size_t)> &progress_;
+  Sha256 sha_;
+};
+
+static bool insecure_registry(const std::string &registry) {
+  if (registry.rfind("localhost", 0) == 0 || registry.rfind("127.", 0) == 0) {
+    return true;
+  }
+  const char *env = getenv("CAPPRUN_INSECURE_REGISTRIES");
+  if (env != nullptr) {
+    std::vector<std::string> hosts;
+    boost::split(hosts, env, boost::is_any_of(","));
+    for (const auto &h : hosts) {
+      if (h == registry) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+ImageRef ImageRef::Parse(const std::string &image) {
+  ImageRef ref;
+  std::string rest = image;
+  auto at = rest.find('@');
+  if (at != std::string::npos) {
+    ref.reference = rest.substr(at + 1);
+    rest = rest.substr(0, at);
+  }
+
+  auto slash = rest.find('/');
+  auto first = rest.substr(0, slash);
+  if (slash != std::string::npos &&
+      (first.find_first_of(".:") != std::string::npos ||
+       first == "localhost")) {
+    ref.registry = first;
+    rest = rest.substr(slash + 1);
+  } else {
+    ref.registry = "docker.io";
+  }
+  if (ref.registry == "docker.io" || ref.registry == "index.docker.io") {
+    ref.registry = "registry-1.docker.io";
+    if (rest.find('/') == std::string::npos) {
+      rest = "library/" + rest;
+    }
+  }
+
+  // A tag is ignored when pinned by digest
+  auto colon = rest.rfind(':');
+  if (colon != std::string::npos) {
+    if (ref.reference.empty()) {
+      ref.reference = rest.substr(colon + 1);
+    }
+    rest = rest.substr(0, colon);
+  }
+  if (ref.reference.empty()) {
+    ref.reference = "latest";
+  }
+  ref.repository = rest;
+  ref.insecure = insecure_registry(ref.registry);
+  return ref;
+}
+
+static bool is_index(const nlohmann::json &data) {
+  return data.contains("manifests");
+}
+
+static std::string select_platform(const nlohmann::json &index,
+                                   const std::string &arch) {
+  for (const auto &m : index.at("manifests")) {
+    auto p = m.value("platform", nlohmann::json::object());
+    if (p.value("os", "") == "linux" && p.value("architecture", "") == arch) {
+      return m.at("digest").get<std::string>();
+    }
+  }
+  throw std::runtime_error("Image has no manifest for linux/" + arch);
+}
+
+static ImageManifest parse_manifest(const std::string &digest,
+                                    const nlohmann::json &data) {
+  ImageManifest manifest;
+  manifest.digest = digest;
+  for (const auto &l : data.at("layers")) {
+    Layer layer;
+    layer.digest = l.at("digest").get<std::string>();
+    layer.media_type = l.value("mediaType", "");
+    layer.size = l.value("size", 0UL);
+    manifest.layers.emplace_back(layer);
+  }
+  return manifest;
+}
+
+static std::string base64_decode(const std::string &in) {
+  std::string out(3 * in.size() / 4 + 1, '\0');
+  int len = EVP_DecodeBlock((unsigned char *)&out[0],
+                            (const unsigned char *)in.data(), in.size());
+  if (len < 0) {
+    throw std::runtime_error("Invalid base64 credentials");
+  }
+  out.resize(len);
+  // EVP_DecodeBlock doesn't account for padding
+  while (!out.empty() && out.back() == '\0') {
+    out.pop_back();
+  }
+  return out;
+}
+
+// Credentials from the docker client config in "user:password" form
+static std::string docker_credentials(const std::string &registry) {
+  boost::filesystem::path cfg;
+  const char *env = getenv("DOCKER_CONFIG");
+  if (env != nullptr) {
+    cfg = env;
+  } else if ((env = getenv("HOME")) != nullptr) {
+    cfg = boost::filesystem::path(env) / ".docker";
+  }
+  cfg /= "config.json";
+  if (!boost::filesystem::exists(cfg)) {
+    return "";
+  }
+
+  nlohmann::json data;
+  open_read(cfg) >> data;
+  std::string key = registry;
+  if (registry == "registry-1.docker.io") {
+    key = "https://index.docker.io/v1/";
+  }
+
+  std::string helper;
+  if (data["credHelpers"].is_object() && data["credHelpers"].contains(key)) {
+    helper = data["credHelpers"][key].get<std::string>();
+  } else if (data["credsStore"].is_string()) {
+    helper = data["credsStore"].get<std::string>();
+  }
+  if (!helper.empty()) {
+    namespace bp = boost::process;
+    try {
+      bp::opstream in;
+      bp::ipstream out;
+      bp::child c(bp::search_path("docker-credential-" + helper), "get",
+                  bp::std_in < in, bp::std_out > out);
+      in << key;
+      in.flush();
+      in.pipe().close();
+      nlohmann::json creds;
+      out >> creds;
+      c.wait();
+      if (c.exit_code() == 0) {
+        return creds.at("Username").get<std::string>() + ":" +
+               creds.at("Secret").get<std::string>();
+      }
+    } catch (const std::exception &ex) {
+      // fall back to anything in "auths"
+    }
+  }
+
+  if (data["auths"].is_object() && data["auths"].contains(key)) {
+    auto auth = data["auths"][key]["auth"];
+    if (auth.is_string()) {
+      return base64_decode(auth.get<std::string>());
+    }
+  }
+  return "";
+}
+
+struct http_response {
+  long code;
+  std::string content_type;
+  std::string challenge; // WWW-Authenticate
+};
+
+using http_sink = std::function<void(const char *, size_t)>;
+
+struct http_transfer {
+  CURL *curl;
+  http_response *resp;
+  const http_sink *sink;
+};
+
+static size_t http_header(char *buf, size_t size, size_t nmemb, void *data) {
+  auto *t = (http_transfer *)data;
+  std::string line(buf, size * nmemb);
+  auto colon = line.find(':');
+  if (colon != std::string::npos) {
+    auto name = boost::to_lower_copy(line.substr(0, colon));
+    auto val = boost::trim_copy(line.substr(colon + 1));
+    if (name == "content-type") {
+      t->resp->content_type = val;
+    } else if (name == "www-authenticate") {
+      t->resp->challenge = val;
+    }
+  }
+  return size * nmemb;
+}
+
+static size_t http_write(char *buf, size_t size, size_t nmemb, void *data) {
+  auto *t = (http_transfer *)data;
+  long code = 0;
+  curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &code);
+  // Only pass along the body of successful responses
+  if (code >= 200 && code < 300) {
+    try {
+      (*t->sink)(buf, size * nmemb);
+    } catch (const std::exception &ex) {
+      return 0;
+    }
+  }
+  return size * nmemb;
+}
+
+static http_response http_get(const std::string &url,
+                              const std::vector<std::string> &headers,
+                              const std::string &userpwd,
+                              const http_sink &sink) {
+  static std::once_flag init;
+  std::call_once(init, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+  http_response resp{};
+  CURL *curl = curl_easy_init();
+  if (curl == nullptr) {
+    throw std::runtime_error("Unable to initialize libcurl");
+  }
+  struct curl_slist *hdrs = nullptr;
+  for (const auto &h : headers) {
+    hdrs = curl_slist_append(hdrs, h.c_str());
+  }
+  http_transfer t{curl, &resp, &sink};
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hdrs);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, http_header);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &t);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_write);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &t);
+  if (!userpwd.empty()) {
+    curl_easy_setopt(curl, CURLOPT_USERPWD, userpwd.c_str());
+  }
+  auto rc = curl_easy_perform(curl);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp.code);
+  curl_slist_free_all(hdrs);
+  curl_easy_cleanup(curl);
+  if (rc != CURLE_OK) {
+    throw std::runtime_error("Unable to fetch " + url + ": " +
+                             curl_easy_strerror(rc));
+  }
+  return resp;
+}
+
+// key="value",key2="value2" from a WWW-Authenticate header
+static std::map<std::string, std::string>
+parse_challenge(const std::string &challenge) {
+  std::map<std::string, std::string> params;
+  auto space = challenge.find(' ');
+  params["scheme"] = boost::to_lower_copy(challenge.substr(0, space));
+  size_t pos = space == std::string::npos ? challenge.size() : space + 1;
+  while (pos < challenge.size()) {
+    auto eq = challenge.find('=', pos);
+    if (eq == std::string::npos) {
+      break;
+    }
+    auto key = boost::trim_copy(challenge.substr(pos, eq - pos));
+    std::string val;
+    pos = eq + 1;
+    if (pos < challenge.size() && challenge[pos] == '"') {
+      auto end = challenge.find('"', pos + 1);
+      val = challenge.substr(pos + 1, end - pos - 1);
+      pos = end == std::string::npos ? challenge.size() : end + 1;
+    } else {
+      auto end = challenge.find(',', pos);
+      val = challenge.substr(pos, end - pos);
+      pos = end == std::string::npos ? challenge.size() : end;
+    }
+    params[key] = val;
+    pos = challenge.find_first_not_of(", ", pos);
+    if (pos == std::string::npos) {
+      break;
+    }
+  }
+  return params;
+}
+
+class RegistrySource : public ImageSource {
+public:
+  RegistrySource(const ImageRef &ref) : ref_(ref) {}
+  ImageManifest manifest(const std::string &arch) override;
+  void fetch_blob(const Layer &layer, const boost::filesystem::path &dst,
+                  const std::function<void(size_t)> &progress) override;
+
+private:
+  std::string url(const std::string &path) const {
+    return std::string(ref_.insecure ? "http://" : "https://") +
+           ref_.registry + "/v2/" + ref_.repository + "/" + path;
+  }
+  http_response get(const std::string &url, const std::string &accept,
+                    const http_sink &sink);
+  void authenticate(const std::string &challenge);
+  std::string fetch_manifest(const std::string &reference,
+                             std::string &digest);
+
+  ImageRef ref_;
+  std::mutex lock_;
+  std::string auth_;
+};
+
+void RegistrySource::authenticate(const std::string &challenge) {
+  auto params = parse_challenge(challenge);
+  auto creds = docker_credentials(ref_.registry);
+  std::string auth;
+  if (params["scheme"] == "basic") {
+    if (creds.empty()) {
+      throw std::runtime_error("No credentials for " + ref_.registry);
+    }
+    std::string encoded(4 * ((creds.size() + 2) / 3) + 1, '\0');
+    int len = EVP_EncodeBlock((unsigned char *)&encoded[0],
+                              (const unsigned char *)creds.data(),
+                              creds.size());
+    encoded.resize(len);
+    auth = "Basic " + encoded;
+  } else if (params["scheme"] == "bearer") {
+    std::string url = params["realm"] + "?service=" + params["service"];
+    url += "&scope=" + params["scope"];
+    std::string body;
+    auto resp = http_get(url, {}, creds, [&body](const char *buf, size_t len) {
+      body.append(buf, len);
+    });
+    if (resp.code != 200) {
+      throw std::runtime_error("Unable to get token for " + ref_.registry +
+                               ": HTTP " + std::to_string(resp.code));
+    }
+    auto data = nlohmann::json::parse(body);
+    auto token = data.contains("token") ? data["token"] : data["access_token"];
+    auth = "Bearer " + token.get<std::string>();
+  } else {
+    throw std::runtime_error("Unsupported registry auth: " + challenge);
+  }
+  std::lock_guard<std::mutex> guard(lock_);
+  auth_ = auth;
+}
+
+http_response RegistrySource::get(const std::string &url,
+                                  const std::string &accept,
+                                  const http_sink &sink) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    std::vector<std::string> headers;
+    if (!accept.empty()) {
+      headers.emplace_back(accept);
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (!auth_.empty()) {
+        headers.emplace_back("Authorization: " + auth_);
+      }
+    }
+    auto resp = http_get(url, headers, "", sink);
+    if (resp.code == 401 && attempt == 0 && !resp.challenge.empty()) {
+      authenticate(resp.challenge);
+      continue;
+    }
+    if (resp.code < 200 || resp.code >= 300) {
+      throw std::runtime_error("Unable to fetch " + url + ": HTTP " +
+                               std::to_string(resp.code));
+    }
+    return resp;
+  }
+  throw std::runtime_error("Unable to authenticate with " + ref_.registry);
+}
+
+std::string RegistrySource::fetch_manifest(const std::string &reference,
+                                           std::string &digest) {
+  std::string body;
+  get(url("manifests/" + reference), manifest_types,
+      [&body](const char *buf, size_t len) { body.append(buf, len); });
+  digest = sha256_digest(body);
+  if (reference.rfind("sha256:", 0) == 0 && digest != reference) {
+    throw std::runtime_error("Digest mismatch for manifest " + reference);
+  }
+  return body;
+}
+
+ImageManifest RegistrySource::manifest(const std::string &arch) {
+  std::string digest;
+  auto data = nlohmann::json::parse(fetch_manifest(ref_.reference, digest));
+  if (is_index(data)) {
+    auto ref = select_platform(data, arch);
+    data = nlohmann::json::parse(fetch_manifest(ref, digest));
+  }
+  return parse_manifest(digest, data);
+}
+
+void RegistrySource::fetch_blob(
+    const Layer &layer, const boost::filesystem::path &dst,
+    const std::function<void(size_t)> &progress) {
+  BlobWriter writer(layer, dst, progress);
+  get(url("blobs/" + layer.digest), "",
+      [&writer](const char *buf, size_t len) { writer.write(buf, len); });
+  writer.commit();
+}
+
+class OciLayoutSource : public ImageSource {
+public:
+  OciLayoutSource(const boost::filesystem::path &dir, const std::string &tag)
+      : dir_(dir), tag_(tag) {}
+  ImageManifest manifest(const std::string &arch) override;
+  void fetch_blob(const Layer &layer, const boost::filesystem::path &dst,
+                  const std::function<void(size_t)> &progress) override;
+
+private:
+  boost::filesystem::path blob(const std::string &digest) const {
+    auto colon = digest.find(':');
+    if (colon == std::string::npos ||
+        digest.find('/') != std::string::npos) {
+      throw std::runtime_error("Invalid digest: " + digest);
+    }
+    return dir_ / "blobs" / digest.substr(0, colon) / digest.substr(colon + 1);
+  }
+  nlohmann::json read_blob(const std::string &digest) const {
+    nlohmann::json data;
+    open_read(blob(digest)) >> data;
+    return data;
+  }
+
+  boost::filesystem::path dir_;
+  std::string tag_;
+};
+
+ImageManifest OciLayoutSource::manifest(const std::string &arch) {
+  nlohmann::json index;
+  open_read(dir_ / "index.json") >> index;
+
+  std::string digest;
+  for (const auto &m : index["manifests"]) {
+    auto annotations = m["annotations"];
+    auto name = annotations.is_object()
+                    ? annotations["org.opencontainers.image.ref.name"]
+                    : nlohmann::json();
+    if (tag_.empty() || (name.is_string() && name == tag_)) {
+      digest = m["digest"].get<std::string>();
+      break;
+    }
+  }
+  if (digest.empty()) {
+    throw std::runtime_error("No image tagged " + tag_ + " in " +
+                             dir_.string());
+  }
+
+  auto data = read_blob(digest);
+  if (is_index(data)) {
+    digest = select_platform(data, arch);
+    data = read_blob(digest);
+  }
+  return parse_manifest(digest, data);
+}
+
+void OciLayoutSource::fetch_blob(
+    const Layer &layer, const boost::filesystem::path &dst,
+    const std::function<void(size_t)> &progress) {
+  BlobWriter writer(layer, dst, progress);
+  auto in = open_read(blob(layer.digest));
+  char buf[65536];
+  while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+    writer.write(buf, in.gcount());
+  }
+  writer.commit();
+}
+
+std::unique_ptr<ImageSource> ImageSource::Create(const std::string &image) {
+  if (image.rfind("oci:", 0) == 0) {
+    std::string path = image.substr(4);
+    std::string tag;
+    auto colon = path.rfind(':');
+    if (colon != std::string::npos &&
+        path.find('/', colon) == std::string::npos) {
+      tag = path.substr(colon + 1);
+      path = path.substr(0, colon);
+    }
+    return std::unique_ptr<ImageSource>(new OciLayoutSource(path, tag));
+  }
+  return std::unique_ptr<ImageSource>(
+      new RegistrySource(ImageRef::Parse(image)));
+}
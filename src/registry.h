@@ -0,0 +1,49 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A parsed image reference such as hub.foundries.io/factory/app@sha256:...
+struct ImageRef {
+  std::string registry;
+  std::string repository;
+  std::string reference; // tag or digest
+  bool insecure;         // talk plain http to the registry
+
+  static ImageRef Parse(const std::string &image);
+};
+
+struct Layer {
+  std::string digest;
+  std::string media_type;
+  uint64_t size;
+};
+
+struct ImageManifest {
+  std::string digest;
+  std::vector<Layer> layers;
+};
+
+// Where image manifests and blobs come from. Images named "oci:<dir>[:tag]"
+// are read from an OCI image layout directory, anything else from a registry.
+class ImageSource {
+public:
+  virtual ~ImageSource() {}
+
+  // The image manifest for the given docker architecture
+  virtual ImageManifest manifest(const std::string &arch) = 0;
+
+  // Save a blob to `dst`, verifying its digest. `progress` is called with
+  // the size of each chunk received.
+  virtual void fetch_blob(const Layer &layer,
+                          const boost::filesystem::path &dst,
+                          const std::function<void(size_t)> &progress) = 0;
+
+  static std::unique_ptr<ImageSource> Create(const std::string &image);
+};
+
+// sha256 of a buffer in "sha256:<hex>" form
+std::string sha256_digest(const std::string &buf);
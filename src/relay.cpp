@@ -0,0 +1,135 @@
+#include "relay.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <system_error>
+#include <unistd.h>
+
+// The default capacity of a pipe
+static const size_t chunk_size = 65536;
+
+struct sink {
+  int fd;
+  int pipe[2]; // holds the tee()'d copy for all but the first sink
+  bool splice;
+  bool dead;
+};
+
+static void write_all(sink &s, const char *buf, size_t len) {
+  while (len > 0 && !s.dead) {
+    ssize_t n = write(s.fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      s.dead = true;
+    } else {
+      buf += n;
+      len -= n;
+    }
+  }
+}
+
+// Move up to `len` bytes from the pipe `from` into `s`, or exactly `len` when
+// `exact` is set. Returns 0 at EOF.
+static size_t transfer(int from, sink &s, size_t len, bool exact) {
+  char buf[chunk_size];
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n;
+    if (s.splice && !s.dead) {
+      n = splice(from, nullptr, s.fd, nullptr, len - done, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINVAL) {
+        // e.g. a tty or a file opened with O_APPEND
+        s.splice = false;
+        continue;
+      } else if (n < 0 && errno != EINTR) {
+        s.dead = true;
+        continue;
+      }
+    } else {
+      n = read(from, buf, std::min(len - done, sizeof(buf)));
+      if (n > 0) {
+        write_all(s, buf, n);
+      }
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to read container output");
+    } else if (n == 0) {
+      break;
+    }
+    done += n;
+    if (!exact) {
+      break;
+    }
+  }
+  return done;
+}
+
+static size_t tee_all(int in, std::vector<sink> &sinks) {
+  size_t len = chunk_size;
+  for (size_t i = 1; i < sinks.size(); i++) {
+    ssize_t n;
+    do {
+      n = tee(in, sinks[i].pipe[1], len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to read container output");
+    } else if (i > 1 && (size_t)n != len) {
+      throw std::runtime_error("Unable to copy container output");
+    }
+    // Every other sink gets what the first tee() saw
+    len = n;
+    if (len == 0) {
+      break;
+    }
+  }
+  return len;
+}
+
+void relay(int in, const std::vector<int> &fds) {
+  std::vector<sink> sinks;
+  auto close_pipes = [&sinks] {
+    for (auto &s : sinks) {
+      if (s.pipe[0] >= 0) {
+        close(s.pipe[0]);
+        close(s.pipe[1]);
+      }
+    }
+  };
+  for (auto fd : fds) {
+    sinks.push_back({fd, {-1, -1}, true, false});
+    if (sinks.size() > 1 && pipe2(sinks.back().pipe, O_CLOEXEC) != 0) {
+      int err = errno;
+      close_pipes();
+      throw std::system_error(err, std::generic_category(),
+                              "Unable to create pipe");
+    }
+  }
+
+  try {
+    while (true) {
+      if (sinks.size() == 1) {
+        if (transfer(in, sinks[0], chunk_size, false) == 0) {
+          break;
+        }
+        continue;
+      }
+      size_t len = tee_all(in, sinks);
+      if (len == 0) {
+        break;
+      }
+      transfer(in, sinks[0], len, true);
+      for (size_t i = 1; i < sinks.size(); i++) {
+        transfer(sinks[i].pipe[0], sinks[i], len, true);
+      }
+    }
+  } catch (...) {
+    close_pipes();
+    throw;
+  }
+  close_pipes();
+}
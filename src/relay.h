@@ -0,0 +1,9 @@
+#pragma once
+
+#include <vector>
+
+// Copy everything from the pipe `in` to each of `sinks` until EOF. Data is
+// moved inside the kernel with splice(), and tee() when there's more than one
+// sink. Sinks splice() can't write to are handled with read()/write(), and a
+// sink that fails is dropped so the container never blocks on it.
+void relay(int in, const std::vector<int> &sinks);
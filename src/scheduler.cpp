@@ -0,0 +1,94 @@
+#include "scheduler.h"
+
+#include <stdexcept>
+
+StartScheduler::StartScheduler(const ProjectDefinition &proj,
+                               size_t parallel)
+    : parallel_(parallel == 0 ? 1 : parallel) {
+  std::set<std::string> names;
+  for (const auto &svc : proj.services) {
+    names.insert(svc.name);
+  }
+  for (const auto &svc : proj.services) {
+    auto &deps = waiting_[svc.name];
+    for (const auto &dep : svc.depends_on) {
+      if (names.count(dep) == 0) {
+        throw std::runtime_error("Service " + svc.name +
+                                 " depends on unknown service " + dep);
+      }
+      deps.insert(dep);
+    }
+    order_.emplace_back(svc.name);
+  }
+
+  // Make sure every service can eventually start
+  std::set<std::string> started;
+  bool progress = true;
+  while (progress && started.size() < names.size()) {
+    progress = false;
+    for (const auto &it : waiting_) {
+      if (started.count(it.first) > 0) {
+        continue;
+      }
+      bool ready = true;
+      for (const auto &dep : it.second) {
+        ready = ready && started.count(dep) > 0;
+      }
+      if (ready) {
+        started.insert(it.first);
+        progress = true;
+      }
+    }
+  }
+  if (started.size() < names.size()) {
+    throw std::runtime_error("Circular depends_on between services");
+  }
+}
+
+std::vector<std::string> StartScheduler::next() {
+  std::vector<std::string> ready;
+  for (const auto &name : order_) {
+    if (starting_.size() >= parallel_) {
+      break;
+    }
+    auto it = waiting_.find(name);
+    if (it != waiting_.end() && it->second.empty()) {
+      ready.emplace_back(name);
+      starting_.insert(name);
+      waiting_.erase(it);
+    }
+  }
+  return ready;
+}
+
+void StartScheduler::running(const std::string &svc) {
+  starting_.erase(svc);
+  for (auto &it : waiting_) {
+    it.second.erase(svc);
+  }
+}
+
+std::vector<std::string> StartScheduler::failed(const std::string &svc) {
+  starting_.erase(svc);
+  std::vector<std::string> skipped;
+  std::set<std::string> dead = {svc};
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (auto it = waiting_.begin(); it != waiting_.end();) {
+      bool blocked = false;
+      for (const auto &dep : it->second) {
+        blocked = blocked || dead.count(dep) > 0;
+      }
+      if (blocked) {
+        dead.insert(it->first);
+        skipped.emplace_back(it->first);
+        it = waiting_.erase(it);
+        progress = true;
+      } else {
+        ++it;
+      }
+    }
+  }
+  return skipped;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "project.h"
+
+// Decides when each service can be started by `upall`. A service is launched
+// once every service it `depends_on` is running, with at most `parallel`
+// services starting at any one time.
+class StartScheduler {
+public:
+  StartScheduler(const ProjectDefinition &proj, size_t parallel);
+
+  // Services that can be launched now. They are marked as starting.
+  std::vector<std::string> next();
+  const std::set<std::string> &starting() const { return starting_; }
+
+  void running(const std::string &svc);
+  // Returns the services that will now never be started.
+  std::vector<std::string> failed(const std::string &svc);
+
+  bool done() const { return starting_.empty() && waiting_.empty(); }
+
+private:
+  size_t parallel_;
+  // service -> dependencies not yet running
+  std::map<std::string, std::set<std::string>> waiting_;
+  std::set<std::string> starting_;
+  std::vector<std::string> order_;
+};
@@ -0,0 +1,234 @@
+#include "seccomp.h"
+
+#ifdef HAVE_LIBSECCOMP
+#include <boost/algorithm/string.hpp>
+#include <openssl/evp.h>
+#include <seccomp.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "registry.h"
+#include "utils.h"
+
+static uint32_t seccomp_action(const std::string &name,
+                               const nlohmann::json &errno_ret) {
+  uint32_t ret = errno_ret.is_number() ? errno_ret.get<uint32_t>() : EPERM;
+  if (name == "SCMP_ACT_KILL" || name == "SCMP_ACT_KILL_THREAD") {
+    return SCMP_ACT_KILL_THREAD;
+  } else if (name == "SCMP_ACT_KILL_PROCESS") {
+    return SCMP_ACT_KILL_PROCESS;
+  } else if (name == "SCMP_ACT_TRAP") {
+    return SCMP_ACT_TRAP;
+  } else if (name == "SCMP_ACT_ERRNO") {
+    return SCMP_ACT_ERRNO(ret);
+  } else if (name == "SCMP_ACT_TRACE") {
+    return SCMP_ACT_TRACE(ret);
+  } else if (name == "SCMP_ACT_ALLOW") {
+    return SCMP_ACT_ALLOW;
+  } else if (name == "SCMP_ACT_LOG") {
+    return SCMP_ACT_LOG;
+  }
+  // SCMP_ACT_NOTIFY needs the runtime to set up a listener
+  throw std::runtime_error("Unsupported seccomp action: " + name);
+}
+
+static enum scmp_compare seccomp_op(const std::string &name) {
+  if (name == "SCMP_CMP_NE") {
+    return SCMP_CMP_NE;
+  } else if (name == "SCMP_CMP_LT") {
+    return SCMP_CMP_LT;
+  } else if (name == "SCMP_CMP_LE") {
+    return SCMP_CMP_LE;
+  } else if (name == "SCMP_CMP_EQ") {
+    return SCMP_CMP_EQ;
+  } else if (name == "SCMP_CMP_GE") {
+    return SCMP_CMP_GE;
+  } else if (name == "SCMP_CMP_GT") {
+    return SCMP_CMP_GT;
+  } else if (name == "SCMP_CMP_MASKED_EQ") {
+    return SCMP_CMP_MASKED_EQ;
+  }
+  throw std::runtime_error("Unsupported seccomp operator: " + name);
+}
+
+// SCMP_ARCH_X86_64 -> x86_64, 0 when libseccomp doesn't know it
+static uint32_t seccomp_arch(const std::string &name) {
+  if (name.rfind("SCMP_ARCH_", 0) != 0) {
+    return 0;
+  }
+  auto lower = boost::algorithm::to_lower_copy(name.substr(10));
+  return seccomp_arch_resolve_name(lower.c_str());
+}
+
+static void add_arch(scmp_filter_ctx ctx, uint32_t arch) {
+  if (arch == 0) {
+    return;
+  }
+  int rc = seccomp_arch_add(ctx, arch);
+  if (rc != 0 && rc != -EEXIST) {
+    throw std::system_error(-rc, std::generic_category(),
+                            "Unable to add seccomp architecture");
+  }
+}
+
+static void add_rules(scmp_filter_ctx ctx, uint32_t default_action,
+                      const nlohmann::json &entry) {
+  uint32_t action = seccomp_action(entry.at("action").get<std::string>(),
+                                   entry.value("errnoRet", nlohmann::json()));
+  if (action == default_action) {
+    return; // libseccomp refuses rules that match the default
+  }
+
+  std::vector<struct scmp_arg_cmp> args;
+  bool repeated = false;
+  for (const auto &arg : entry.value("args", nlohmann::json::array())) {
+    struct scmp_arg_cmp cmp {};
+    cmp.arg = arg.at("index").get<unsigned>();
+    cmp.op = seccomp_op(arg.at("op").get<std::string>());
+    cmp.datum_a = arg.value("value", (uint64_t)0);
+    cmp.datum_b = arg.value("valueTwo", (uint64_t)0);
+    for (const auto &prev : args) {
+      repeated |= prev.arg == cmp.arg;
+    }
+    args.push_back(cmp);
+  }
+
+  std::vector<std::string> names;
+  if (entry.contains("names")) {
+    names = entry["names"].get<std::vector<std::string>>();
+  } else if (entry.contains("name")) {
+    names.push_back(entry["name"].get<std::string>());
+  }
+  for (const auto &name : names) {
+    int nr = seccomp_syscall_resolve_name(name.c_str());
+    if (nr == __NR_SCMP_ERROR) {
+      continue; // not a syscall on this architecture
+    }
+    int rc = 0;
+    if (repeated) {
+      // Conditions on the same argument can't be ANDed in one rule, so like
+      // crun they're added as separate rules that each allow the call.
+      for (const auto &cmp : args) {
+        rc = seccomp_rule_add_array(ctx, action, nr, 1, &cmp);
+        if (rc != 0) {
+          break;
+        }
+      }
+    } else {
+      rc = seccomp_rule_add_array(ctx, action, nr, args.size(), args.data());
+    }
+    if (rc != 0) {
+      throw std::system_error(-rc, std::generic_category(),
+                              "Unable to add seccomp rule for " + name);
+    }
+  }
+}
+
+static std::string compile(const nlohmann::json &profile) {
+  uint32_t default_action =
+      seccomp_action(profile.at("defaultAction").get<std::string>(),
+                     profile.value("defaultErrnoRet", nlohmann::json()));
+  if (!profile.value("listenerPath", "").empty()) {
+    throw std::runtime_error("seccomp listeners can't be precompiled");
+  }
+  std::unique_ptr<void, void (*)(scmp_filter_ctx)> ctx(
+      seccomp_init(default_action), seccomp_release);
+  if (!ctx) {
+    throw std::runtime_error("Unable to initialize seccomp filter");
+  }
+
+  for (const auto &arch : profile.value("architectures", nlohmann::json())) {
+    add_arch(ctx.get(), seccomp_arch(arch.get<std::string>()));
+  }
+  // Docker's own format lists architectures by what the host supports
+  for (const auto &entry : profile.value("archMap", nlohmann::json())) {
+    if (seccomp_arch(entry.value("architecture", "")) !=
+        seccomp_arch_native()) {
+      continue;
+    }
+    for (const auto &sub :
+         entry.value("subArchitectures", nlohmann::json::array())) {
+      add_arch(ctx.get(), seccomp_arch(sub.get<std::string>()));
+    }
+  }
+
+  for (const auto &entry : profile.value("syscalls", nlohmann::json())) {
+    add_rules(ctx.get(), default_action, entry);
+  }
+
+  std::unique_ptr<FILE, int (*)(FILE *)> tmp(tmpfile(), fclose);
+  if (!tmp) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to create temporary file");
+  }
+  int rc = seccomp_export_bpf(ctx.get(), fileno(tmp.get()));
+  if (rc != 0) {
+    throw std::system_error(-rc, std::generic_category(),
+                            "Unable to export seccomp filter");
+  }
+  std::string bpf;
+  char buf[4096];
+  ssize_t n;
+  lseek(fileno(tmp.get()), 0, SEEK_SET);
+  while ((n = read(fileno(tmp.get()), buf, sizeof(buf))) > 0) {
+    bpf.append(buf, n);
+  }
+  if (n < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to read seccomp filter");
+  }
+
+  std::string encoded(4 * ((bpf.size() + 2) / 3) + 1, '\0');
+  int len = EVP_EncodeBlock((unsigned char *)&encoded[0],
+                            (const unsigned char *)bpf.data(), bpf.size());
+  encoded.resize(len);
+  return encoded;
+}
+
+nlohmann::json seccomp_precompile(const boost::filesystem::path &profile,
+                                  const boost::filesystem::path &cache) {
+  std::string content;
+  {
+    auto in = open_read(profile);
+    content.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+  }
+  auto digest = sha256_digest(content).substr(7);
+  auto cached = cache / (digest + "-" + DOCKER_ARCH + ".json");
+
+  nlohmann::json data;
+  if (boost::filesystem::exists(cached)) {
+    try {
+      open_read(cached) >> data;
+      return data;
+    } catch (const std::exception &ex) {
+      // rebuild it below
+    }
+  }
+
+  auto parsed = nlohmann::json::parse(content);
+  try {
+    data["bpf"] = compile(parsed);
+  } catch (const std::exception &ex) {
+    return nullptr;
+  }
+  // The runtime applies the program as-is but still takes its flags from here
+  data["seccomp"] = {{"defaultAction", parsed["defaultAction"]}};
+  for (const auto &key : {"defaultErrnoRet", "flags"}) {
+    if (parsed.contains(key)) {
+      data["seccomp"][key] = parsed[key];
+    }
+  }
+
+  boost::filesystem::create_directories(cache);
+  auto tmp = cached.string() + "." + std::to_string(getpid());
+  open_write(tmp) << data;
+  boost::filesystem::rename(tmp, cached);
+  return data;
+}
+#else
+nlohmann::json seccomp_precompile(const boost::filesystem::path &profile,
+                                  const boost::filesystem::path &cache) {
+  return nullptr;
+}
+#endif
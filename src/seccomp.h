@@ -0,0 +1,14 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+
+#include "json.h"
+
+// Compile the OCI seccomp profile at `profile` into a BPF program for this
+// architecture. Programs are cached in `cache` by the profile's digest, so a
+// profile shared by every service is only compiled once. Returns
+// {"bpf": <base64 program>, "seccomp": <what the runtime still needs>}, or
+// null when capp-run is built without libseccomp or the profile uses
+// something that can't be precompiled (e.g. SCMP_ACT_NOTIFY).
+nlohmann::json seccomp_precompile(const boost::filesystem::path &profile,
+                                  const boost::filesystem::path &cache);
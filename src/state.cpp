@@ -0,0 +1,102 @@
+#include "state.h"
+
+#include <sys/stat.h>
+
+#include "json.h"
+
+#include "cgroup.h"
+
+static bool spec_stat(const boost::filesystem::path &spec, int64_t &mtime,
+                      uint64_t &size) {
+  struct stat st;
+  if (stat(spec.c_str(), &st) != 0) {
+    return false;
+  }
+  mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  size = st.st_size;
+  return true;
+}
+
+AppState::AppState(const Context &ctx) : file_(ctx.var_run / "state.json") {
+  auto buf = file_.read();
+  if (buf.empty()) {
+    return;
+  }
+  auto data = nlohmann::json::parse(buf);
+  for (const auto &it : data.at("services").items()) {
+    const auto &val = it.value();
+    services[it.key()] = {
+        .spec_sha1 = val.value("spec_sha1", ""),
+        .spec_mtime = val.value("spec_mtime", (int64_t)0),
+        .spec_size = val.value("spec_size", (uint64_t)0),
+        .pid = val.value("pid", -1),
+        .started = val.value("started", (int64_t)0),
+        .cgroup = val.value("cgroup", ""),
+    };
+  }
+}
+
+void AppState::save() {
+  nlohmann::json data;
+  data["services"] = nlohmann::json::object();
+  for (const auto &it : services) {
+    data["services"][it.first] = {
+        {"spec_sha1", it.second.spec_sha1},
+        {"spec_mtime", it.second.spec_mtime},
+        {"spec_size", it.second.spec_size},
+        {"pid", it.second.pid},
+        {"started", it.second.started},
+        {"cgroup", it.second.cgroup},
+    };
+  }
+  file_.write(data.dump(2));
+}
+
+void AppState::Started(const Context &ctx, const std::string &svc,
+                       const boost::filesystem::path &spec,
+                       const std::string &spec_sha1) {
+  AppState state(ctx);
+  auto &s = state.services[svc];
+  s.spec_sha1 = spec_sha1;
+  if (!spec_stat(spec, s.spec_mtime, s.spec_size)) {
+    s.spec_mtime = 0;
+    s.spec_size = 0;
+  }
+  s.pid = -1;
+  state.save();
+}
+
+void AppState::Running(const Context &ctx, const std::string &svc, int pid) {
+  AppState state(ctx);
+  auto &s = state.services[svc];
+  s.pid = pid;
+  s.started = time(nullptr);
+  s.cgroup = cgroup_path(pid);
+  state.save();
+}
+
+void AppState::Stopped(const Context &ctx, const std::string &svc) {
+  AppState state(ctx);
+  auto it = state.services.find(svc);
+  if (it != state.services.end()) {
+    it->second.pid = -1;
+    state.save();
+  }
+}
+
+bool spec_current(service_state &state, const boost::filesystem::path &spec) {
+  int64_t mtime;
+  uint64_t size;
+  if (!spec_stat(spec, mtime, size)) {
+    return false;
+  }
+  if (mtime == state.spec_mtime && size == state.spec_size) {
+    return true;
+  }
+  if (sha1sum(spec) != state.spec_sha1) {
+    return false;
+  }
+  state.spec_mtime = mtime;
+  state.spec_size = size;
+  return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <map>
+#include <string>
+
+#include "context.h"
+#include "utils.h"
+
+struct service_state {
+  std::string spec_sha1; // the spec the service was started with
+  int64_t spec_mtime;    // when the spec was hashed, in nanoseconds
+  uint64_t spec_size;
+  int pid; // the container's init process, -1 when not running
+  int64_t started;    // epoch seconds
+  std::string cgroup; // cgroup v2 path of the container
+};
+
+// What each service of an app was started with, kept in var_run/state.json
+// so that status doesn't need to look at crun or /proc.
+class AppState {
+public:
+  // Locks the state file until destroyed
+  AppState(const Context &ctx);
+
+  void save();
+
+  std::map<std::string, service_state> services;
+
+  // Record the spec a service is being started with
+  static void Started(const Context &ctx, const std::string &svc,
+                      const boost::filesystem::path &spec,
+                      const std::string &spec_sha1);
+  static void Running(const Context &ctx, const std::string &svc, int pid);
+  static void Stopped(const Context &ctx, const std::string &svc);
+
+private:
+  LockedFile file_;
+};
+
+// Whether `spec` is what the service was started with. It's only re-hashed
+// when its size or mtime changed, in which case `state` is refreshed if the
+// content turns out to be the same.
+bool spec_current(service_state &state, const boost::filesystem::path &spec);
@@ -0,0 +1,889 @@
+#include "tar.h"
+
+#include <boost/algorithm/string.hpp>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Files bigger than this are written by the thread reading the archive rather
+// than being buffered for the write pool.
+static const size_t inline_write_size = 1 << 20;
+// How much file content may be buffered waiting to be written
+static const size_t write_budget = 32 << 20;
+// Each queued file holds an open fd, so layers of many empty or tiny files
+// are bounded by count as well as by size. At most a quarter of the fd limit
+// is used for them.
+static const size_t max_queued_jobs = 256;
+
+// Reads a file, transparently decompressing gzip or zstd
+class Decompressor {
+public:
+  Decompressor(const boost::filesystem::path &path);
+  ~Decompressor();
+  Decompressor(const Decompressor &) = delete;
+  Decompressor &operator=(const Decompressor &) = delete;
+
+  // Returns the number of bytes read, less than `len` only at the end
+  size_t read(char *buf, size_t len);
+
+private:
+  enum class Format { None, Gzip, Zstd };
+
+  // Make sure there's compressed input available, returns false at EOF
+  bool fill_input();
+  size_t decompress(char *buf, size_t len);
+
+  int fd_;
+  Format format_;
+  std::vector<char> in_;
+  size_t in_pos_;
+  size_t in_len_;
+  bool eof_;
+  z_stream zs_;
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd_;
+  // The last ZSTD_decompressStream() result, 0 when a frame was completed
+  size_t zstd_rc_;
+#endif
+};
+
+Decompressor::Decompressor(const boost::filesystem::path &path)
+    : format_(Format::None), in_(1 << 17), in_pos_(0), in_len_(0),
+      eof_(false), zs_() {
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to open " + path.string());
+  }
+  fill_input();
+  auto magic = (const unsigned char *)in_.data();
+  if (in_len_ >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    format_ = Format::Gzip;
+    // 16 + MAX_WBITS: expect a gzip header
+    if (inflateInit2(&zs_, 16 + MAX_WBITS) != Z_OK) {
+      close(fd_);
+      throw std::runtime_error("Unable to initialize zlib");
+    }
+  } else if (in_len_ >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+             magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifdef HAVE_ZSTD
+    format_ = Format::Zstd;
+    zstd_ = ZSTD_createDStream();
+    ZSTD_initDStream(zstd_);
+    zstd_rc_ = 0;
+#else
+    close(fd_);
+    throw std::runtime_error("zstd compressed layers are not supported");
+#endif
+  }
+}
+
+Decompressor::~Decompressor() {
+  if (format_ == Format::Gzip) {
+    inflateEnd(&zs_);
+  }
+#ifdef HAVE_ZSTD
+  if (format_ == Format::Zstd) {
+    ZSTD_freeDStream(zstd_);
+  }
+#endif
+  close(fd_);
+}
+
+bool Decompressor::fill_input() {
+  if (in_pos_ < in_len_) {
+    return true;
+  }
+  while (!eof_) {
+    ssize_t n = ::read(fd_, in_.data(), in_.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to read layer");
+    } else if (n == 0) {
+      eof_ = true;
+    } else {
+      in_pos_ = 0;
+      in_len_ = n;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t Decompressor::decompress(char *buf, size_t len) {
+  while (true) {
+    // Even once the input is exhausted the decoder may still hold output
+    // that didn't fit in `buf`, so it's called until it produces nothing
+    bool more = fill_input();
+    size_t produced = 0;
+    if (format_ == Format::Gzip) {
+      zs_.next_in = (Bytef *)in_.data() + in_pos_;
+      zs_.avail_in = in_len_ - in_pos_;
+      zs_.next_out = (Bytef *)buf;
+      zs_.avail_out = len;
+      int rc = inflate(&zs_, Z_NO_FLUSH);
+      in_pos_ = in_len_ - zs_.avail_in;
+      produced = len - zs_.avail_out;
+      if (rc == Z_STREAM_END) {
+        // gzip allows several members to be concatenated
+        inflateReset(&zs_);
+      } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+        throw std::runtime_error("Invalid gzip data in layer");
+      }
+    }
+#ifdef HAVE_ZSTD
+    else if (format_ == Format::Zstd) {
+      if (!more && zstd_rc_ == 0) {
+        return 0; // the last frame was complete and fully flushed
+      }
+      ZSTD_inBuffer in = {in_.data(), in_len_, in_pos_};
+      ZSTD_outBuffer out = {buf, len, 0};
+      size_t rc = ZSTD_decompressStream(zstd_, &out, &in);
+      if (ZSTD_isError(rc)) {
+        throw std::runtime_error(std::string("Invalid zstd data in layer: ") +
+                                 ZSTD_getErrorName(rc));
+      }
+      in_pos_ = in.pos;
+      produced = out.pos;
+      zstd_rc_ = rc;
+      if (!more && produced == 0) {
+        throw std::runtime_error("Truncated zstd data in layer");
+      }
+    }
+#endif
+    if (produced > 0) {
+      return produced;
+    } else if (!more) {
+      return 0;
+    }
+  }
+}
+
+size_t Decompressor::read(char *buf, size_t len) {
+  size_t total = 0;
+  while (total < len) {
+    size_t n;
+    if (format_ == Format::None) {
+      if (!fill_input()) {
+        break;
+      }
+      n = std::min(len - total, in_len_ - in_pos_);
+      memcpy(buf + total, in_.data() + in_pos_, n);
+      in_pos_ += n;
+    } else {
+      n = decompress(buf + total, len - total);
+      if (n == 0) {
+        break;
+      }
+    }
+    total += n;
+  }
+  return total;
+}
+
+// Writes file contents and metadata on a few threads. The amount of data and
+// the number of jobs queued are bounded so a big layer can't use up all the
+// memory or file descriptors.
+class WritePool {
+public:
+  WritePool(size_t threads)
+      : queued_(0), max_jobs_(max_queued_jobs), stop_(false) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur / 4 < max_jobs_) {
+      max_jobs_ = std::max<size_t>(1, rl.rlim_cur / 4);
+    }
+    for (size_t i = 0; i < threads; i++) {
+      threads_.emplace_back(&WritePool::run, this);
+    }
+  }
+  ~WritePool() {
+    if (!threads_.empty()) {
+      try {
+        finish();
+      } catch (...) {
+      }
+    }
+  }
+
+  void submit(std::function<void()> job, size_t bytes) {
+    if (threads_.empty()) {
+      job();
+      return;
+    }
+    std::unique_lock<std::mutex> guard(lock_);
+    space_.wait(guard, [&] {
+      return (queued_ < write_budget && queue_.size() < max_jobs_) || err_;
+    });
+    if (err_) {
+      std::rethrow_exception(err_);
+    }
+    queue_.emplace_back(std::move(job), bytes);
+    queued_ += bytes;
+    ready_.notify_one();
+  }
+
+  // Wait for all queued work, rethrowing the first failure
+  void finish() {
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      stop_ = true;
+    }
+    ready_.notify_all();
+    for (auto &t : threads_) {
+      t.join();
+    }
+    threads_.clear();
+    if (err_) {
+      std::rethrow_exception(err_);
+    }
+  }
+
+private:
+  void run() {
+    while (true) {
+      std::pair<std::function<void()>, size_t> job;
+      {
+        std::unique_lock<std::mutex> guard(lock_);
+        ready_.wait(guard, [&] { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) {
+          return;
+        }
+        job = std::move(queue_.front());
+        queue_.pop_front();
+      }
+      try {
+        job.first();
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!err_) {
+          err_ = std::current_exception();
+        }
+      }
+      {
+        std::lock_guard<std::mutex> guard(lock_);
+        queued_ -= job.second;
+      }
+      space_.notify_one();
+    }
+  }
+
+  std::mutex lock_;
+  std::condition_variable ready_;
+  std::condition_variable space_;
+  std::deque<std::pair<std::function<void()>, size_t>> queue_;
+  size_t queued_;
+  size_t max_jobs_;
+  bool stop_;
+  std::exception_ptr err_;
+  std::vector<std::thread> threads_;
+};
+
+struct tar_entry {
+  std::string path;
+  std::string linkpath;
+  char type;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  uint64_t size;
+  struct timespec mtime;
+  unsigned devmajor;
+  unsigned devminor;
+  std::vector<std::pair<std::string, std::string>> xattrs;
+};
+
+struct ustar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+static_assert(sizeof(ustar_header) == 512, "Invalid tar header layout");
+
+static std::string field(const char *buf, size_t len) {
+  return std::string(buf, strnlen(buf, len));
+}
+
+static uint64_t number(const char *buf, size_t len) {
+  auto *p = (const unsigned char *)buf;
+  uint64_t val = 0;
+  if (p[0] & 0x80) {
+    // GNU base-256 encoding for values that don't fit in octal
+    val = p[0] & 0x7f;
+    for (size_t i = 1; i < len; i++) {
+      val = (val << 8) | p[i];
+    }
+    return val;
+  }
+  size_t i = 0;
+  while (i < len && (p[i] == ' ' || p[i] == '\0')) {
+    i++;
+  }
+  for (; i < len && p[i] >= '0' && p[i] <= '7'; i++) {
+    val = (val << 3) | (p[i] - '0');
+  }
+  return val;
+}
+
+static bool valid_checksum(const ustar_header &hdr) {
+  auto *p = (const unsigned char *)&hdr;
+  uint64_t sum = 0;
+  for (size_t i = 0; i < sizeof(hdr); i++) {
+    bool in_chksum = i >= offsetof(ustar_header, chksum) &&
+                     i < offsetof(ustar_header, chksum) + sizeof(hdr.chksum);
+    sum += in_chksum ? ' ' : p[i];
+  }
+  return sum == number(hdr.chksum, sizeof(hdr.chksum));
+}
+
+static struct timespec parse_time(const std::string &val) {
+  struct timespec ts {};
+  auto dot = val.find('.');
+  ts.tv_sec = std::stoll(val.substr(0, dot));
+  if (dot != std::string::npos) {
+    auto frac = val.substr(dot + 1, 9);
+    frac.append(9 - frac.size(), '0');
+    ts.tv_nsec = std::stol(frac);
+  }
+  return ts;
+}
+
+// Apply "<len> <key>=<value>\n" PAX records to the next entry
+static void parse_pax(const std::string &data, tar_entry &entry) {
+  size_t pos = 0;
+  while (pos < data.size()) {
+    auto space = data.find(' ', pos);
+    if (space == std::string::npos) {
+      break;
+    }
+    size_t len = std::stoul(data.substr(pos, space - pos));
+    if (len == 0 || pos + len > data.size()) {
+      throw std::runtime_error("Invalid pax header in layer");
+    }
+    auto record = data.substr(space + 1, pos + len - space - 2);
+    pos += len;
+    auto eq = record.find('=');
+    if (eq == std::string::npos) {
+      continue;
+    }
+    auto key = record.substr(0, eq);
+    auto val = record.substr(eq + 1);
+    if (key == "path") {
+      entry.path = val;
+    } else if (key == "linkpath") {
+      entry.linkpath = val;
+    } else if (key == "size") {
+      entry.size = std::stoull(val);
+    } else if (key == "uid") {
+      entry.uid = std::stoul(val);
+    } else if (key == "gid") {
+      entry.gid = std::stoul(val);
+    } else if (key == "mtime") {
+      entry.mtime = parse_time(val);
+    } else if (key.rfind("SCHILY.xattr.", 0) == 0) {
+      entry.xattrs.emplace_back(key.substr(13), val);
+    }
+  }
+}
+
+// Split an archive path into its components, refusing to leave the root
+static std::vector<std::string> components(const std::string &path) {
+  std::vector<std::string> parts;
+  std::vector<std::string> out;
+  boost::split(parts, path, boost::is_any_of("/"));
+  for (const auto &p : parts) {
+    if (p.empty() || p == ".") {
+      continue;
+    } else if (p == "..") {
+      throw std::runtime_error("Invalid path in layer: " + path);
+    }
+    out.emplace_back(p);
+  }
+  return out;
+}
+
+class Extractor {
+public:
+  Extractor(const boost::filesystem::path &dst, size_t jobs);
+  ~Extractor();
+  void run(Decompressor &in);
+
+private:
+  struct dir_meta {
+    std::vector<std::string> path;
+    tar_entry entry;
+  };
+
+  void read_exact(Decompressor &in, char *buf, size_t len);
+  void skip(Decompressor &in, uint64_t len);
+  std::string read_data(Decompressor &in, uint64_t len);
+  bool next(Decompressor &in, tar_entry &entry);
+
+  // A directory fd for the parent of `parts`, creating missing directories
+  int parent(const std::vector<std::string> &parts, bool create);
+  int open_dir(const std::vector<std::string> &parts, size_t count,
+               bool create);
+  void remove_existing(int dirfd, const std::string &name, bool keep_dir);
+
+  void extract(Decompressor &in, tar_entry &entry);
+  void extract_file(Decompressor &in, int dirfd, const std::string &name,
+                    tar_entry &entry);
+  void apply_meta(int dirfd, const std::string &name, const tar_entry &entry,
+                  bool symlink);
+
+  int root_;
+  bool chown_;
+  std::vector<std::string> cached_path_;
+  int cached_fd_;
+  std::vector<dir_meta> dirs_;
+  WritePool pool_;
+};
+
+Extractor::Extractor(const boost::filesystem::path &dst, size_t jobs)
+    : chown_(geteuid() == 0), cached_fd_(-1), pool_(jobs) {
+  root_ = open(dst.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_ < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to open " + dst.string());
+  }
+}
+
+Extractor::~Extractor() {
+  if (cached_fd_ >= 0) {
+    close(cached_fd_);
+  }
+  close(root_);
+}
+
+void Extractor::read_exact(Decompressor &in, char *buf, size_t len) {
+  if (in.read(buf, len) != len) {
+    throw std::runtime_error("Unexpected end of layer");
+  }
+}
+
+void Extractor::skip(Decompressor &in, uint64_t len) {
+  char buf[65536];
+  while (len > 0) {
+    size_t n = std::min<uint64_t>(len, sizeof(buf));
+    read_exact(in, buf, n);
+    len -= n;
+  }
+}
+
+std::string Extractor::read_data(Decompressor &in, uint64_t len) {
+  std::string data(len, '\0');
+  if (len > 0) {
+    read_exact(in, &data[0], len);
+  }
+  skip(in, (512 - len % 512) % 512);
+  return data;
+}
+
+// Read the next entry's header, following GNU long name and PAX headers
+bool Extractor::next(Decompressor &in, tar_entry &entry) {
+  // PAX values override the header's. These mark the ones that weren't given
+  // since zero is a valid size, uid, gid and mtime.
+  tar_entry ext{};
+  ext.size = UINT64_MAX;
+  ext.uid = (uid_t)-1;
+  ext.gid = (gid_t)-1;
+  ext.mtime.tv_sec = -1;
+  bool have_path = false;
+  bool have_link = false;
+  while (true) {
+    ustar_header hdr;
+    size_t n = in.read((char *)&hdr, sizeof(hdr));
+    if (n == 0 || (n == sizeof(hdr) && hdr.name[0] == '\0')) {
+      return false; // end of archive
+    } else if (n != sizeof(hdr) || !valid_checksum(hdr)) {
+      throw std::runtime_error("Invalid tar header in layer");
+    }
+
+    uint64_t size = number(hdr.size, sizeof(hdr.size));
+    if (hdr.typeflag == 'L') {
+      ext.path = read_data(in, size).c_str();
+      have_path = true;
+      continue;
+    } else if (hdr.typeflag == 'K') {
+      ext.linkpath = read_data(in, size).c_str();
+      have_link = true;
+      continue;
+    } else if (hdr.typeflag == 'x' || hdr.typeflag == 'g') {
+      tar_entry pax{};
+      pax.size = UINT64_MAX;
+      pax.uid = (uid_t)-1;
+      pax.gid = (gid_t)-1;
+      pax.mtime.tv_sec = -1;
+      parse_pax(read_data(in, size), pax);
+      // Global headers are rare in image layers, treat them as local ones
+      if (!pax.path.empty()) {
+        ext.path = pax.path;
+        have_path = true;
+      }
+      if (!pax.linkpath.empty()) {
+        ext.linkpath = pax.linkpath;
+        have_link = true;
+      }
+      if (pax.size != UINT64_MAX) {
+        ext.size = pax.size;
+      }
+      if (pax.uid != (uid_t)-1) {
+        ext.uid = pax.uid;
+      }
+      if (pax.gid != (gid_t)-1) {
+        ext.gid = pax.gid;
+      }
+      if (pax.mtime.tv_sec != -1) {
+        ext.mtime = pax.mtime;
+      }
+      ext.xattrs = pax.xattrs;
+      continue;
+    }
+
+    entry = tar_entry{};
+    entry.type = hdr.typeflag;
+    if (have_path) {
+      entry.path = ext.path;
+    } else {
+      auto prefix = field(hdr.prefix, sizeof(hdr.prefix));
+      entry.path = field(hdr.name, sizeof(hdr.name));
+      if (!prefix.empty() && memcmp(hdr.magic, "ustar", 5) == 0 &&
+          hdr.version[0] == '0') {
+        entry.path = prefix + "/" + entry.path;
+      }
+    }
+    entry.linkpath =
+        have_link ? ext.linkpath : field(hdr.linkname, sizeof(hdr.linkname));
+    entry.mode = number(hdr.mode, sizeof(hdr.mode)) & 07777;
+    entry.uid = number(hdr.uid, sizeof(hdr.uid));
+    entry.gid = number(hdr.gid, sizeof(hdr.gid));
+    entry.size = size;
+    entry.mtime.tv_sec = number(hdr.mtime, sizeof(hdr.mtime));
+    entry.devmajor = number(hdr.devmajor, sizeof(hdr.devmajor));
+    entry.devminor = number(hdr.devminor, sizeof(hdr.devminor));
+    if (ext.size != UINT64_MAX) {
+      entry.size = ext.size;
+    }
+    if (ext.uid != (uid_t)-1) {
+      entry.uid = ext.uid;
+    }
+    if (ext.gid != (gid_t)-1) {
+      entry.gid = ext.gid;
+    }
+    if (ext.mtime.tv_sec != -1) {
+      entry.mtime = ext.mtime;
+    }
+    entry.xattrs = ext.xattrs;
+    return true;
+  }
+}
+
+int Extractor::open_dir(const std::vector<std::string> &parts, size_t count,
+                        bool create) {
+  int fd = dup(root_);
+  for (size_t i = 0; i < count; i++) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int next = openat(fd, parts[i].c_str(), flags);
+    if (next < 0 && errno == ENOENT && create) {
+      if (mkdirat(fd, parts[i].c_str(), 0755) == 0 || errno == EEXIST) {
+        next = openat(fd, parts[i].c_str(), flags);
+      }
+    }
+    int err = errno;
+    close(fd);
+    if (next < 0) {
+      // O_NOFOLLOW makes sure a symlink can't take us outside of the layer
+      throw std::system_error(err, std::generic_category(),
+                              "Unable to open directory " +
+                                  boost::join(parts, "/") + " in layer");
+    }
+    fd = next;
+  }
+  return fd;
+}
+
+int Extractor::parent(const std::vector<std::string> &parts, bool create) {
+  // Archives list a directory's entries together, so remember the last one
+  std::vector<std::string> dir(parts.begin(), parts.end() - 1);
+  if (cached_fd_ >= 0 && dir == cached_path_) {
+    return cached_fd_;
+  }
+  int fd = open_dir(dir, dir.size(), create);
+  if (cached_fd_ >= 0) {
+    close(cached_fd_);
+  }
+  cached_fd_ = fd;
+  cached_path_ = dir;
+  return fd;
+}
+
+void Extractor::remove_existing(int dirfd, const std::string &name,
+                                bool keep_dir) {
+  struct stat st;
+  if (fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    return;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    if (keep_dir) {
+      return;
+    }
+    // Replacing a directory is rare, let boost do the recursion
+    auto fd_path = "/proc/self/fd/" + std::to_string(dirfd);
+    auto real = boost::filesystem::read_symlink(fd_path) / name;
+    boost::filesystem::remove_all(real);
+    if (cached_fd_ >= 0) {
+      close(cached_fd_);
+      cached_fd_ = -1;
+    }
+  } else if (unlinkat(dirfd, name.c_str(), 0) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to replace " + name + " in layer");
+  }
+}
+
+void Extractor::apply_meta(int dirfd, const std::string &name,
+                           const tar_entry &entry, bool symlink) {
+  int flags = symlink ? AT_SYMLINK_NOFOLLOW : 0;
+  if (chown_ &&
+      fchownat(dirfd, name.c_str(), entry.uid, entry.gid, flags) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to chown " + entry.path);
+  }
+  // chown clears setuid bits, so the mode must come after it
+  if (!symlink && fchmodat(dirfd, name.c_str(), entry.mode, 0) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to chmod " + entry.path);
+  }
+  struct timespec times[2] = {entry.mtime, entry.mtime};
+  if (utimensat(dirfd, name.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to set mtime of " + entry.path);
+  }
+}
+
+static void set_xattrs(int fd, const tar_entry &entry) {
+  for (const auto &x : entry.xattrs) {
+    if (fsetxattr(fd, x.first.c_str(), x.second.data(), x.second.size(),
+                  0) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to set " + x.first + " on " +
+                                  entry.path);
+    }
+  }
+}
+
+void Extractor::extract_file(Decompressor &in, int dirfd,
+                             const std::string &name, tar_entry &entry) {
+  int fd = openat(dirfd, name.c_str(),
+                  O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to create " + entry.path);
+  }
+
+  auto finish = [fd, chown = chown_](const std::string &data,
+                                     const tar_entry &entry) {
+    size_t off = 0;
+    while (off < data.size()) {
+      ssize_t n = write(fd, data.data() + off, data.size() - off);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n < 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "Unable to write " + entry.path);
+      }
+      off += n;
+    }
+    struct timespec times[2] = {entry.mtime, entry.mtime};
+    if ((chown && fchown(fd, entry.uid, entry.gid) != 0) ||
+        fchmod(fd, entry.mode) != 0 || futimens(fd, times) != 0) {
+      int err = errno;
+      close(fd);
+      throw std::system_error(err, std::generic_category(),
+                              "Unable to set attributes of " + entry.path);
+    }
+    try {
+      set_xattrs(fd, entry);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+  };
+
+  if (entry.size <= inline_write_size) {
+    auto data = read_data(in, entry.size);
+    size_t bytes = data.size();
+    pool_.submit(
+        [finish, data = std::move(data), entry]() { finish(data, entry); },
+        bytes);
+    return;
+  }
+
+  // Stream big files straight to disk
+  char buf[65536];
+  uint64_t left = entry.size;
+  while (left > 0) {
+    size_t n = std::min<uint64_t>(left, sizeof(buf));
+    read_exact(in, buf, n);
+    left -= n;
+    for (size_t off = 0; off < n;) {
+      ssize_t w = write(fd, buf + off, n - off);
+      if (w < 0 && errno == EINTR) {
+        continue;
+      } else if (w < 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "Unable to write " + entry.path);
+      }
+      off += w;
+    }
+  }
+  skip(in, (512 - entry.size % 512) % 512);
+  finish("", entry);
+}
+
+void Extractor::extract(Decompressor &in, tar_entry &entry) {
+  auto parts = components(entry.path);
+  bool has_data = entry.type == '0' || entry.type == '\0' ||
+                  entry.type == '7';
+  if (parts.empty()) {
+    // The layer's root directory
+    skip(in, (entry.size + 511) / 512 * 512);
+    return;
+  }
+  const auto &name = parts.back();
+
+  int dirfd = parent(parts, true);
+  if (name == ".wh..wh..opq") {
+    if (fsetxattr(dirfd, "trusted.overlay.opaque", "y", 1, 0) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to mark opaque " + entry.path);
+    }
+  } else if (name.rfind(".wh.", 0) == 0) {
+    auto target = name.substr(4);
+    remove_existing(dirfd, target, false);
+    dirfd = parent(parts, true);
+    if (mknodat(dirfd, target.c_str(), S_IFCHR, makedev(0, 0)) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to whiteout " + entry.path);
+    }
+  } else if (entry.type == '5') {
+    remove_existing(dirfd, name, true);
+    dirfd = parent(parts, true);
+    if (mkdirat(dirfd, name.c_str(), 0700) != 0 && errno != EEXIST) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to create " + entry.path);
+    }
+    // Creating its contents changes the mtime, so apply this at the end
+    dirs_.push_back({parts, entry});
+  } else if (has_data) {
+    remove_existing(dirfd, name, false);
+    dirfd = parent(parts, true);
+    extract_file(in, dirfd, name, entry);
+    return;
+  } else {
+    remove_existing(dirfd, name, false);
+    dirfd = parent(parts, true);
+    int rc = 0;
+    bool symlink = false;
+    if (entry.type == '1') {
+      auto target = components(entry.linkpath);
+      if (target.empty()) {
+        throw std::runtime_error("Invalid hardlink in layer: " + entry.path);
+      }
+      int tfd = open_dir(target, target.size() - 1, false);
+      rc = linkat(tfd, target.back().c_str(), dirfd, name.c_str(), 0);
+      int err = errno;
+      close(tfd);
+      errno = err;
+    } else if (entry.type == '2') {
+      rc = symlinkat(entry.linkpath.c_str(), dirfd, name.c_str());
+      symlink = true;
+    } else if (entry.type == '3' || entry.type == '4') {
+      mode_t kind = entry.type == '3' ? S_IFCHR : S_IFBLK;
+      rc = mknodat(dirfd, name.c_str(), kind | entry.mode,
+                   makedev(entry.devmajor, entry.devminor));
+    } else if (entry.type == '6') {
+      rc = mkfifoat(dirfd, name.c_str(), entry.mode);
+    } else {
+      // Unknown entry types (e.g. sparse files) are skipped
+      skip(in, (entry.size + 511) / 512 * 512);
+      return;
+    }
+    if (rc != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to create " + entry.path);
+    }
+    // Hardlinks share the metadata of their target
+    if (entry.type != '1') {
+      apply_meta(dirfd, name, entry, symlink);
+    }
+  }
+  skip(in, (entry.size + 511) / 512 * 512);
+}
+
+void Extractor::run(Decompressor &in) {
+  tar_entry entry;
+  while (next(in, entry)) {
+    extract(in, entry);
+  }
+  pool_.finish();
+
+  // Deepest first so setting a parent's mtime comes last
+  for (auto it = dirs_.rbegin(); it != dirs_.rend(); ++it) {
+    int fd = open_dir(it->path, it->path.size(), false);
+    try {
+      set_xattrs(fd, it->entry);
+      struct timespec times[2] = {it->entry.mtime, it->entry.mtime};
+      if ((chown_ && fchown(fd, it->entry.uid, it->entry.gid) != 0) ||
+          fchmod(fd, it->entry.mode) != 0 || futimens(fd, times) != 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "Unable to set attributes of " +
+                                    it->entry.path);
+      }
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+  }
+}
+
+void tar_extract(const boost::filesystem::path &tarball,
+                 const boost::filesystem::path &dst, size_t jobs) {
+  Decompressor in(tarball);
+  Extractor extractor(dst, jobs);
+  extractor.run(in);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+
+// Unpack an image layer, which may be gzip or zstd compressed, into `dst`.
+// Entries are created in archive order while file contents and metadata are
+// written by up to `jobs` threads. Whiteouts are stored the way overlayfs
+// expects them: 0/0 character devices and an opaque xattr on directories.
+void tar_extract(const boost::filesystem::path &tarball,
+                 const boost::filesystem::path &dst, size_t jobs);
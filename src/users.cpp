@@ -0,0 +1,279 @@
+#include "users.h"
+
+#include <algorithm>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "utils.h"
+
+struct field {
+  const char *ptr;
+  size_t len;
+
+  std::string str() const { return std::string(ptr, len); }
+};
+
+static bool parse_id(const char *ptr, size_t len, uint32_t &id) {
+  if (len == 0 || len > 10) {
+    return false;
+  }
+  uint64_t val = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (ptr[i] < '0' || ptr[i] > '9') {
+      return false;
+    }
+    val = val * 10 + (ptr[i] - '0');
+  }
+  if (val > UINT32_MAX) {
+    return false;
+  }
+  id = val;
+  return true;
+}
+
+static bool parse_id(const std::string &str, uint32_t &id) {
+  return parse_id(str.data(), str.size(), id);
+}
+
+// Split `[pos, end)` on `sep` into at most `max` fields
+static size_t split(const char *pos, const char *end, char sep, field *fields,
+                    size_t max) {
+  size_t n = 0;
+  while (n < max) {
+    auto next = (const char *)memchr(pos, sep, end - pos);
+    auto field_end = next == nullptr ? end : next;
+    fields[n++] = {pos, (size_t)(field_end - pos)};
+    if (next == nullptr) {
+      break;
+    }
+    pos = next + 1;
+  }
+  return n;
+}
+
+// Call `fn` with the fields of each line of a colon separated database
+template <size_t N, typename Fn>
+static void each_entry(const std::string &content, Fn fn) {
+  const char *pos = content.data();
+  const char *end = pos + content.size();
+  while (pos < end) {
+    auto nl = (const char *)memchr(pos, '\n', end - pos);
+    auto eol = nl == nullptr ? end : nl;
+    field fields[N];
+    if (eol > pos && *pos != '#' && split(pos, eol, ':', fields, N) == N) {
+      fn(fields);
+    }
+    pos = eol + 1;
+  }
+}
+
+static nlohmann::json parse_passwd(const std::string &content) {
+  nlohmann::json index = nlohmann::json::object();
+  // name:password:uid:gid:...
+  each_entry<4>(content, [&index](const field *f) {
+    uint32_t uid, gid;
+    auto name = f[0].str();
+    if (!name.empty() && !index.contains(name) &&
+        parse_id(f[2].ptr, f[2].len, uid) &&
+        parse_id(f[3].ptr, f[3].len, gid)) {
+      index[name] = {uid, gid};
+    }
+  });
+  return index;
+}
+
+static nlohmann::json parse_group(const std::string &content) {
+  nlohmann::json index = nlohmann::json::object();
+  // name:password:gid:member,member...
+  each_entry<4>(content, [&index](const field *f) {
+    uint32_t gid;
+    auto name = f[0].str();
+    if (name.empty() || index.contains(name) ||
+        !parse_id(f[2].ptr, f[2].len, gid)) {
+      return;
+    }
+    auto members = nlohmann::json::array();
+    const char *pos = f[3].ptr;
+    const char *end = pos + f[3].len;
+    while (pos < end) {
+      field member;
+      split(pos, end, ',', &member, 1);
+      if (member.len > 0) {
+        members.push_back(member.str());
+      }
+      pos += member.len + 1;
+    }
+    index[name] = {gid, members};
+  });
+  return index;
+}
+
+static std::string read_file(const boost::filesystem::path &p) {
+  auto in = open_read(p);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+// Where `rel` in a rootfs comes from and where its index may be cached
+struct source {
+  boost::filesystem::path file; // empty when the file doesn't exist
+  boost::filesystem::path cache;
+};
+
+static bool is_whiteout(const struct stat &st) {
+  return S_ISCHR(st.st_mode) && st.st_rdev == 0;
+}
+
+// Look through an overlay's layers, top first, for the one providing `rel`
+static source find_source(const boost::filesystem::path &rootfs,
+                          const std::string &rel, const std::string &suffix) {
+  auto base = rootfs.parent_path();
+  if (!boost::filesystem::exists(base / ".lower")) {
+    return {rootfs / rel, ""};
+  }
+  std::vector<boost::filesystem::path> layers{base / ".upper"};
+  auto lowerf = open_read(base / ".lower");
+  std::string line;
+  while (std::getline(lowerf, line)) {
+    if (!line.empty()) {
+      layers.emplace_back(line);
+    }
+  }
+
+  auto dir = boost::filesystem::path(rel).parent_path();
+  for (const auto &layer : layers) {
+    struct stat st;
+    if (lstat((layer / dir).c_str(), &st) == 0 && is_whiteout(st)) {
+      return {};
+    }
+    if (lstat((layer / rel).c_str(), &st) == 0) {
+      if (is_whiteout(st)) {
+        return {};
+      } else if (!S_ISREG(st.st_mode)) {
+        // e.g. a symlink, let the overlay resolve it
+        return {rootfs / rel, ""};
+      }
+      return {layer / rel, layer.string() + suffix};
+    }
+    // An opaque directory hides the layers below it
+    char opaque;
+    if (getxattr((layer / dir).c_str(), "trusted.overlay.opaque", &opaque,
+                 1) == 1 &&
+        opaque == 'y') {
+      return {};
+    }
+  }
+  return {};
+}
+
+// The parsed form of a rootfs's `rel`, from its cache when that's current
+static nlohmann::json
+load_index(const boost::filesystem::path &rootfs, const std::string &rel,
+           const std::string &suffix,
+           nlohmann::json (*parse)(const std::string &content)) {
+  auto src = find_source(rootfs, rel, suffix);
+  if (src.file.empty()) {
+    return nlohmann::json::object();
+  }
+  if (src.cache.empty()) {
+    return boost::filesystem::exists(src.file) ? parse(read_file(src.file))
+                                               : nlohmann::json::object();
+  }
+
+  struct stat st;
+  if (stat(src.file.c_str(), &st) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to stat " + src.file.string());
+  }
+  int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  if (boost::filesystem::exists(src.cache)) {
+    try {
+      nlohmann::json cached;
+      open_read(src.cache) >> cached;
+      if (cached.at("size").get<int64_t>() == st.st_size &&
+          cached.at("mtime").get<int64_t>() == mtime) {
+        return cached.at("entries");
+      }
+    } catch (const std::exception &ex) {
+      // rebuild it below
+    }
+  }
+
+  nlohmann::json cached = {{"size", st.st_size},
+                            {"mtime", mtime},
+                            {"entries", parse(read_file(src.file))}};
+  try {
+    auto tmp = src.cache.string() + "." + std::to_string(getpid());
+    open_write(tmp) << cached;
+    boost::filesystem::rename(tmp, src.cache);
+  } catch (const std::exception &ex) {
+    // only a cache, e.g. the layer may be read-only
+  }
+  return cached["entries"];
+}
+
+UserDb UserDb::Load(const boost::filesystem::path &rootfs) {
+  UserDb db;
+  auto passwd = load_index(rootfs, "etc/passwd", ".passwd", parse_passwd);
+  for (const auto &it : passwd.items()) {
+    db.users[it.key()] = {it.value()[0].get<uint32_t>(),
+                          it.value()[1].get<uint32_t>()};
+  }
+  auto group = load_index(rootfs, "etc/group", ".group", parse_group);
+  for (const auto &it : group.items()) {
+    db.groups[it.key()] = {it.value()[0].get<uint32_t>(),
+                           it.value()[1].get<std::vector<std::string>>()};
+  }
+  return db;
+}
+
+void UserDb::resolve(const std::string &user, uint32_t &uid, uint32_t &gid,
+                     std::vector<uint32_t> &additional_gids) const {
+  auto sep = user.find(':');
+  auto name = user.substr(0, sep);
+  std::string group = sep == std::string::npos ? "" : user.substr(sep + 1);
+
+  const std::string *matched = nullptr;
+  gid = 0;
+  if (parse_id(name, uid)) {
+    for (const auto &it : users) {
+      if (it.second.uid == uid) {
+        matched = &it.first;
+        gid = it.second.gid;
+        break;
+      }
+    }
+  } else {
+    auto it = users.find(name);
+    if (it == users.end()) {
+      throw std::runtime_error("Unable to find user " + name);
+    }
+    matched = &it->first;
+    uid = it->second.uid;
+    gid = it->second.gid;
+  }
+
+  if (!group.empty()) {
+    if (!parse_id(group, gid)) {
+      auto it = groups.find(group);
+      if (it == groups.end()) {
+        throw std::runtime_error("Unable to find group " + group);
+      }
+      gid = it->second.gid;
+    }
+  } else if (matched != nullptr) {
+    for (const auto &it : groups) {
+      const auto &members = it.second.members;
+      if (it.second.gid != gid &&
+          std::find(members.begin(), members.end(), *matched) !=
+              members.end() &&
+          std::find(additional_gids.begin(), additional_gids.end(),
+                    it.second.gid) == additional_gids.end()) {
+        additional_gids.push_back(it.second.gid);
+      }
+    }
+  }
+}
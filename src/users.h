@@ -0,0 +1,35 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <map>
+#include <string>
+#include <vector>
+
+struct passwd_entry {
+  uint32_t uid;
+  uint32_t gid;
+};
+
+struct group_entry {
+  uint32_t gid;
+  std::vector<std::string> members;
+};
+
+// The users and groups defined by a rootfs's etc/passwd and etc/group
+class UserDb {
+public:
+  // When `rootfs` is one of our overlays (its .upper and .lower sit beside
+  // it) the files are read from the layer that provides them and the parsed
+  // index is cached beside that layer, so it's shared by every image using
+  // the layer and only rebuilt when the file changes.
+  static UserDb Load(const boost::filesystem::path &rootfs);
+
+  // Resolve a compose `user` of the form user[:group], where each may be a
+  // name or number, the way docker does. Supplementary groups are those
+  // listing the user as a member, unless a group is given explicitly.
+  void resolve(const std::string &user, uint32_t &uid, uint32_t &gid,
+               std::vector<uint32_t> &additional_gids) const;
+
+  std::map<std::string, passwd_entry> users;
+  std::map<std::string, group_entry> groups;
+};
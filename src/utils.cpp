@@ -1,6 +1,9 @@
 #include "utils.h"
 
 #include <boost/uuid/detail/sha1.hpp>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
 
 std::ofstream open_write(const boost::filesystem::path &p) {
   std::ofstream f(p.string());
@@ -40,4 +43,59 @@ std::string sha1sum(const boost::filesystem::path &p) {
     sprintf(dgst + (i << 3), "%08x", hash[i]);
   }
   return std::string(dgst);
-}
\ No newline at end of file
+}
+
+LockedFile::LockedFile(const boost::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  fd_ = fd < 0 ? NULL : fdopen(fd, "r+");
+  if (fd_ == NULL) {
+    int err = errno;
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw std::system_error(err, std::generic_category(),
+                            "Unable to open " + path.string());
+  }
+  if (flock(fileno(fd_), LOCK_EX) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to lock " + path.string());
+  }
+}
+
+LockedFile::~LockedFile() { fclose(fd_); }
+
+std::string LockedFile::read() const {
+  fseek(fd_, 0, SEEK_END);
+  size_t size = ftell(fd_);
+  fseek(fd_, 0, SEEK_SET);
+
+  char *buf = (char *)calloc(size + 1, 1);
+  if (fread(buf, 1, size, fd_) != size) {
+    free(buf);
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to read contents file");
+  }
+  std::string rv(buf);
+  free(buf);
+  return rv;
+}
+
+void LockedFile::write(const std::string &buf) {
+  // Overwrite and then trim rather than truncating first so that readers of
+  // the file never see it empty
+  size_t off = 0;
+  while (off < buf.size()) {
+    ssize_t n = pwrite(fileno(fd_), buf.data() + off, buf.size() - off, off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Unable to write contents file");
+    }
+    off += n;
+  }
+  if (ftruncate(fileno(fd_), buf.size()) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Unable to truncate contents file");
+  }
+}
@@ -2,7 +2,22 @@
 
 #include <boost/filesystem.hpp>
 #include <fstream>
+#include <stdio.h>
 
 std::ifstream open_read(const boost::filesystem::path &p);
 std::ofstream open_write(const boost::filesystem::path &p);
-std::string sha1sum(const boost::filesystem::path &p);
\ No newline at end of file
+std::string sha1sum(const boost::filesystem::path &p);
+
+// A file held under an exclusive flock until destroyed
+class LockedFile {
+public:
+  LockedFile(const boost::filesystem::path &path);
+  ~LockedFile();
+
+  std::string read() const;
+  // Replace the contents in place, so bind mounts of the file see them
+  void write(const std::string &buf);
+
+private:
+  FILE *fd_;
+};